@@ -12,6 +12,7 @@
 #include <iostream>
 #include <limits>
 #include <type_traits>
+#include <vector>
 #include <glm/glm.hpp>
 #include "zekku/Pool.h"
 #include "zekku/QuadTree.h"
@@ -81,9 +82,10 @@ namespace zekku {
     static_assert(std::numeric_limits<F>::is_specialized,
       "Your F is not a number, dum dum!");
     // using BF = BloomFilter<BBHandle, BBHandleHasher, 1>;
+    using HandleType = BBHandle;
     template<typename... Args>
     BoxQuadTree(const AABB<F>& box, Args&&... args) :
-        root((I) nodes.allocate()), box(box), gbox(args...) {}
+        root((I) nodes.allocate(I(NOWHERE), box)), box(box), gbox(args...) {}
     BoxQuadTree(QuadTree<T, I, F, nc, GetBB>&& other) :
         nodes(std::move(other.nodes)), root(other.root),
         box(other.box), gbox(other.gbox) {
@@ -93,27 +95,34 @@ namespace zekku {
       T t2 = t;
       return insert(std::move(t2));
     }
+    // An element outside the box makes the tree grow (see growToFit).
     BBHandle insert(T&& t) {
       B p = gbox(t);
-      if (!p.isWithin(box)) {
-        std::cerr << "(" << p.c.x << ", " << p.c.y << ") +/- (";
-        std::cerr << p.s.x << ", " << p.s.y;
-        std::cerr << ") is out of range!\n";
-        std::cerr << "Box is centred at (" << box.c[0] << ", " << box.c[1] << ") ";
-        std::cerr << "with w = " << box.s[0] << " and h = " << box.s[1] << "\n";
-        exit(-1);
-      }
+      growToFit(p);
       uint32_t ti = (uint32_t) canonicals.allocate(std::move(t));
       BBHandle h = insert(canonicals.get(ti), ti, p, root, box);
       assert(nodes.getCapacity() <= std::numeric_limits<I>::max());
       return h;
     }
+    // Removes the element at h, which stops being valid. A link node left
+    // empty at the end of its chain is dropped, and a stem whose children
+    // are all empty leaves becomes a leaf again, up the tree as far as
+    // possible.
+    void remove(const BBHandle& h) {
+      I at = where[h.index];
+      detach(h.index, at, BBHash<F>()(gbox(canonicals.get(h.index))));
+      canonicals.deallocate(h.index);
+      prune(at);
+    }
+    size_t size() const { return canonicals.size(); }
     const T& deref(const BBHandle& h) const {
       return canonicals.get(h.index);
     }
     T& deref(const BBHandle& h) {
       return canonicals.get(h.index);
     }
+    // Queries only read the tree, so any number of threads can run them
+    // at once as long as nothing is modifying it.
     template<typename Q = AABB<T>>
     void query(const Q& shape, std::vector<BBHandle>& out) const {
       query(shape, out, root, box);
@@ -135,6 +144,20 @@ namespace zekku {
         callback(std::move(canonicals.get(h.index)));
       }
     }
+    // Calls callback(a, b) once for each pair of elements whose boxes
+    // intersect, in one pass over the tree. Elements in different
+    // children of a stem can't touch (or they would be in the stem), so
+    // each element is only tested against the rest of its chain and the
+    // elements above it whose boxes reach its node.
+    // B needs intersects(const B&) for this.
+    // In a loose tree, the subtrees of neighbouring children can overlap,
+    // so they are also joined with each other (see join).
+    template<typename C>
+    void forEachOverlappingPair(C callback) const {
+      std::vector<PairEntry> stack;
+      std::vector<BBHandle> scratch;
+      pairs(root, 0, stack, scratch, callback);
+    }
     template<typename C>
     void apply(const C& f) {
       // Apply f to each element and rebuild the tree.
@@ -146,14 +169,144 @@ namespace zekku {
         insert(t, it.i, p, root, box);
       }
     }
+    // Same, but keeps the tree and moves only the elements that have to
+    // move. An element stays in its node as long as its new box is still
+    // within the node's without touching the nodes next to it and (if the
+    // node is a stem) doesn't fit in one of its children. Otherwise it
+    // goes up to the nearest node where it fits and back down from there
+    // as far as it can go, ending up where insert would have put it.
+    // This pays off when most elements move less than a node each time.
+    template<typename C>
+    void applyIncremental(const C& f) {
+      for (auto it = canonicals.begin(); it != canonicals.end(); ++it) {
+        T& t = *it;
+        uint32_t ti = (uint32_t) it.i;
+        size_t oldHash = BBHash<F>()(gbox(t));
+        f(t);
+        B p = gbox(t);
+        I at = where[ti];
+        if (!p.isWithin(box)) {
+          // Growing can move other elements around, so take t out first.
+          // If the tree has to be rebuilt to grow, t is put back with the
+          // rest.
+          detach(ti, at, oldHash);
+          prune(at);
+          if (!grow(p)) insert(t, ti, p, root, box);
+          continue;
+        }
+        const Node& n = nodes.get(at);
+        bool fits = fitsIn(p, at);
+        if (fits &&
+            (!nodes.get(tailOf(at)).stem || childFor(p, n.box) == 4)) {
+          nodes.get(at).hash ^= oldHash ^ BBHash<F>()(p);
+          continue;
+        }
+        rehome(ti, p, at, oldHash, fits);
+      }
+    }
+    // Packs the elements together in memory so that full passes such as
+    // apply touch fewer cache lines. This invalidates existing handles;
+    // the returned vector maps each old handle index to its new one.
+    std::vector<size_t> compact(bool shrink = false) {
+      std::vector<size_t> remap = canonicals.compact(shrink);
+      for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+        Node& n = *it;
+        for (I i = 0; i < n.nodeCount; ++i)
+          n.nodes[i] = (uint32_t) remap[n.nodes[i]];
+      }
+      std::vector<I> moved(canonicals.getCapacity());
+      for (size_t i = 0; i < remap.size(); ++i) {
+        if (remap[i] < moved.size()) moved[remap[i]] = where[i];
+      }
+      where = std::move(moved);
+      return remap;
+    }
+    const AABB<F>& getBox() const { return box; }
+    // Makes this a loose quadtree, where each node is treated as k times
+    // as big as its box, keeping the same centre. An element then goes
+    // into the child that its centre is in, as long as it is within that
+    // child's loose box, so elements near the lines between children sink
+    // as deep as their size allows instead of staying at the top of the
+    // tree. Queries have to look at more nodes in return.
+    // k = 1 (the default) is an ordinary quadtree. Rebuilds the tree.
+    void setLooseness(F k) {
+      if (!(k >= F(1))) {
+        std::cerr << "Looseness has to be at least 1!\n";
+        exit(-1);
+      }
+      looseness = k;
+      rebuild();
+    }
+    F getLooseness() const { return looseness; }
+    // Grows the box until p is within it, doubling it at most
+    // QUADTREE_MAX_GROWTH times towards centreOf(p). As in QuadTree, each
+    // doubling puts a new root above the old one, so nothing is
+    // reinserted unless rounding stops the old box from being an exact
+    // quadrant of the new one. Handles stay valid either way.
+    void growToFit(const B& p) {
+      grow(p);
+    }
+    // Shrinks the box back down while all of the elements are in one
+    // quadrant of the root, making that quadrant the root (and moving any
+    // elements kept in the root itself down into it).
+    // Returns true if the box changed.
+    bool shrinkToFit() {
+      bool shrunk = false;
+      while (true) {
+        const Node& r = nodes.get(root);
+        if (!r.stem) return shrunk;
+        I children[4];
+        std::copy(r.children, r.children + 4, children);
+        unsigned used = 0;
+        for (uint32_t c = 0; c < 4; ++c) {
+          const Node& child = nodes.get(children[c]);
+          if (child.stem || child.link || child.nodeCount != 0)
+            used |= 1 << c;
+        }
+        for (I i = 0; i < r.nodeCount; ++i) {
+          B p = gbox(canonicals.get(r.nodes[i]));
+          for (uint32_t c = 0; c < 4; ++c) {
+            if (p.intersects(box.getSubboxByClass(c))) used |= 1 << c;
+          }
+        }
+        if (used == 0 || (used & (used - 1)) != 0) return shrunk;
+        uint32_t only = (uint32_t) ctz64(used);
+        AABB<F> sub = box.getSubboxByClass(only);
+        if (loose()) {
+          // Elements in a loose quadrant can still stick out of it
+          std::vector<BBHandle> all;
+          query(QueryAll<F>(), all, root, box);
+          for (BBHandle h : all) {
+            if (!gbox(canonicals.get(h.index)).isWithin(sub)) return shrunk;
+          }
+        }
+        std::vector<uint32_t> own(r.nodes, r.nodes + r.nodeCount);
+        for (uint32_t c = 0; c < 4; ++c) {
+          if (c != only) nodes.deallocate(children[c]);
+        }
+        nodes.deallocate(root);
+        root = children[only];
+        nodes.get(root).parent = NOWHERE;
+        box = sub;
+        for (uint32_t ti : own)
+          insert(canonicals.get(ti), ti, gbox(canonicals.get(ti)), root, box);
+        shrunk = true;
+      }
+    }
     void dump() const {
       dump(root, box);
     }
+    template<typename, typename, typename, size_t, typename, typename>
+    friend class BoxQuadTree;
+    template<typename TreeA, typename TreeB, typename C>
+    friend void join(const TreeA& ta, const TreeB& tb, C callback);
   private:
+    static constexpr I NOWHERE = -1;
     class Node {
     public:
-      Node() :
-        hash(0), nodeCount(0), link(false), stem(false) {}
+      Node(I parent = NOWHERE, const AABB<F>& box = AABB<F>()) :
+        hash(0), box(box), parent(parent),
+        nodeCount(0), link(false), stem(false) {}
       // The following fields are unspecified if neither stem nor link is set.
       // If link is set, then children[0] contains the node with 
       // additional nodes and the rest of the fields are unspecified.
@@ -167,6 +320,9 @@ namespace zekku {
       // before you can see the children of the node, but this
       // simplifies the logic.)
       size_t hash;
+      AABB<F> box;
+      // The node whose children (or link) lead here
+      I parent;
       I children[4];
       I nodeCount;
       bool link, stem;
@@ -174,19 +330,204 @@ namespace zekku {
     };
     Pool<Node> nodes;
     Pool<T> canonicals;
+    // The node holding each element, by index in canonicals
+    std::vector<I> where;
     I root;
     AABB<F> box;
+    F looseness = F(1);
     ZK_NOUNIQADDR GetBB gbox;
+    bool loose() const { return looseness > F(1); }
+    // The box that the elements in a node with box b are within
+    AABB<F> bounds(const AABB<F>& b) const {
+      return loose() ? AABB<F>{b.c, b.s * looseness} : b;
+    }
     void clearTree() {
       // Clears the tree structure, but not the elements themselves.
       size_t oc = nodes.getCapacity();
       nodes = Pool<Node>(oc);
-      root = createNode();
+      root = createNode(NOWHERE, box);
+    }
+    void rebuild() {
+      clearTree();
+      for (auto it = canonicals.begin(); it != canonicals.end(); ++it)
+        insert(*it, it.i, gbox(*it), root, box);
     }
-    I createNode() {
-      size_t i = nodes.allocate();
+    I createNode(I parent, const AABB<F>& b) {
+      size_t i = nodes.allocate(parent, b);
       return (I) i;
     }
+    // growToFit, returning true if it had to rebuild the tree
+    bool grow(const B& p) {
+      if (p.isWithin(box)) return false;
+      glm::tvec2<F> towards = centreOf(p);
+      AABB<F> target = box;
+      bool exact = true;
+      for (size_t i = 0; !p.isWithin(target); ++i) {
+        if (i == QUADTREE_MAX_GROWTH) {
+          std::cerr << "(" << p.c.x << ", " << p.c.y << ") +/- (";
+          std::cerr << p.s.x << ", " << p.s.y;
+          std::cerr << ") is out of range!\n";
+          std::cerr << "Box is centred at (" << box.c[0] << ", " << box.c[1] << ") ";
+          std::cerr << "with w = " << box.s[0] << " and h = " << box.s[1] << "\n";
+          exit(-1);
+        }
+        uint32_t q;
+        AABB<F> grown = growToward(target, towards, q);
+        if (!(grown.getSubboxByClass(q) == target)) exact = false;
+        target = grown;
+      }
+      const Node& r = nodes.get(root);
+      // A lone leaf doesn't care what its box is
+      if (!r.stem && !r.link) {
+        box = target;
+        nodes.get(root).box = box;
+        return false;
+      }
+      if (!exact) {
+        box = target;
+        rebuild();
+        return true;
+      }
+      while (!(box == target)) {
+        uint32_t q;
+        AABB<F> grown = growToward(box, towards, q);
+        I stem = createNode(NOWHERE, grown);
+        I children[4];
+        for (uint32_t c = 0; c < 4; ++c) {
+          children[c] = c == q ? root :
+            createNode(stem, grown.getSubboxByClass(c));
+        }
+        nodes.get(root).parent = stem;
+        Node& s = nodes.get(stem);
+        std::copy(children, children + 4, s.children);
+        s.stem = true;
+        root = stem;
+        box = grown;
+      }
+      return false;
+    }
+    I tailOf(I node) const {
+      while (nodes.get(node).link) node = nodes.get(node).children[0];
+      return node;
+    }
+    // Whether insert would leave p in node (or elsewhere in its chain),
+    // which is when p is within the node's box and touches none of the
+    // nodes next to it. (Sides on the edge of the root's box are skipped,
+    // with some slack so that rounding doesn't put a node across them.)
+    // In a loose tree, p has to be within the node's loose box and have
+    // its centre in the node's box instead.
+    bool fitsIn(const B& p, I node) const {
+      const AABB<F>& b = nodes.get(node).box;
+      if (loose()) return p.isWithin(bounds(b)) && b.contains(centreOf(p));
+      if (!p.isWithin(b)) return false;
+      glm::tvec2<F> w = b.s + b.s;
+      glm::tvec2<F> slack = b.s * oneHalf<F>;
+      for (uint32_t side = 0; side < 4; ++side) {
+        int axis = side >> 1;
+        bool up = (side & 1) != 0;
+        bool interior = up ?
+          b.c[axis] + b.s[axis] + slack[axis] < box.c[axis] + box.s[axis] :
+          b.c[axis] - b.s[axis] - slack[axis] > box.c[axis] - box.s[axis];
+        if (!interior) continue;
+        AABB<F> next = b;
+        next.c[axis] = up ? b.c[axis] + w[axis] : b.c[axis] - w[axis];
+        if (p.intersects(next)) return false;
+      }
+      return true;
+    }
+    // Moves element ti, whose box is now p (and used to hash to oldHash),
+    // out of node at and into the node insert would put it in. fits is
+    // fitsIn(p, at); if so, p can only have to go further down.
+    void rehome(uint32_t ti, const B& p, I at, size_t oldHash, bool fits) {
+      detach(ti, at, oldHash);
+      // Stems are at the end of their chains, so inserting at at will
+      // find the stem; otherwise climb up until p fits
+      I to = at;
+      if (!fits) {
+        while (!fitsIn(p, to)) to = nodes.get(to).parent;
+      }
+      insert(canonicals.get(ti), ti, p, to, nodes.get(to).box);
+      prune(at);
+    }
+    // Tidies up after taking an element out of node: see remove.
+    void prune(I node) {
+      while (true) {
+        const Node& n = nodes.get(node);
+        if (n.link || n.stem || n.nodeCount != 0 || n.parent == NOWHERE)
+          return;
+        I up = n.parent;
+        Node& pn = nodes.get(up);
+        if (pn.link) {
+          // The node before an empty one in a chain is full
+          pn.link = false;
+          nodes.deallocate(node);
+          return;
+        }
+        for (I child : pn.children) {
+          const Node& cn = nodes.get(child);
+          if (cn.link || cn.stem || cn.nodeCount != 0) return;
+        }
+        for (I child : pn.children) nodes.deallocate(child);
+        pn.stem = false;
+        node = up;
+      }
+    }
+    // The child of a stem with box b that p goes into, or 4 if p touches
+    // more than one of them (or in a loose tree, isn't within the loose
+    // box of the one its centre is in) and has to stay in the stem
+    uint32_t childFor(const B& p, const AABB<F>& b) const {
+      if (loose()) {
+        uint32_t c = (uint32_t) b.getClass(centreOf(p));
+        return p.isWithin(bounds(b.getSubboxByClass(c))) ? c : 4;
+      }
+      unsigned count = 0;
+      uint32_t index = 0;
+      for (uint32_t c = 0; c < 4; ++c) {
+        if (p.intersects(b.getSubboxByClass(c))) {
+          ++count;
+          index = c;
+        }
+      }
+      // By now, at least one element of intersect *should* be true,
+      // but rounding errors can result in p intersecting with box
+      // but not with any of its subboxes.
+      return count >= 2 ? 4 : index;
+    }
+    // Takes element ti (whose box hashes to h) out of node at. Link nodes
+    // have to stay full, so a hole in one is filled with the last element
+    // of its chain; if the last node is empty, the one before it gives
+    // up an element and takes the last node's place.
+    void detach(uint32_t ti, I at, size_t h) {
+      Node& n = nodes.get(at);
+      I k = 0;
+      while (n.nodes[k] != ti) ++k;
+      n.hash ^= h;
+      if (!n.link) {
+        n.nodes[k] = n.nodes[--n.nodeCount];
+        return;
+      }
+      I tail = tailOf(at);
+      Node& tn = nodes.get(tail);
+      I from = tn.nodeCount != 0 ? tail : tn.parent;
+      Node& fn = nodes.get(from);
+      uint32_t last = fn.nodes[--fn.nodeCount];
+      if (last != ti) {
+        size_t lh = BBHash<F>()(gbox(canonicals.get(last)));
+        fn.hash ^= lh;
+        n.hash ^= lh;
+        n.nodes[k] = last;
+        where[last] = at;
+      }
+      if (from != tail) {
+        fn.link = false;
+        fn.stem = tn.stem;
+        if (tn.stem) {
+          std::copy(tn.children, tn.children + 4, fn.children);
+          for (I child : fn.children) nodes.get(child).parent = from;
+        }
+        nodes.deallocate(tail);
+      }
+    }
 #define isNowhere (np->stem)
 #define isLink    (np->link)
 #define numNodes  (np->nodeCount)
@@ -195,41 +536,12 @@ namespace zekku {
         size_t root,
         const AABB<F>& box) {
       Node* np = &nodes.get(root);
-      // Find out which subboxes this object intersects
-      unsigned count = 0;
-      unsigned index = 0;
-      if (p.intersects(box.nw())) {
-        ++count;
-        index = 0;
-      }
-      if (p.intersects(box.ne())) {
-        ++count;
-        index = 1;
-      }
-      if (p.intersects(box.sw())) {
-        ++count;
-        index = 2;
-      }
-      if (p.intersects(box.se())) {
-        ++count;
-        index = 3;
-      }
-      // By now, at least one element of intersect *should* be true,
-      // but rounding errors can result in p intersecting with box
-      // but not with any of its subboxes.
+      uint32_t c = childFor(p, box);
       // Intersects two or more quadrants?
-      if (count >= 2) {
+      if (c == 4) {
         return insert(t, ti, p, root, box, true);
       }
-      // Otherwise...
-      if (index == 0)
-        insert(t, ti, p, np->children[0], box.nw());
-      if (index == 1)
-        insert(t, ti, p, np->children[1], box.ne());
-      if (index == 2)
-        insert(t, ti, p, np->children[2], box.sw());
-      if (index == 3)
-        insert(t, ti, p, np->children[3], box.se());
+      insert(t, ti, p, np->children[c], box.getSubboxByClass(c));
       // We can just return ti
       // since that's the index into the `canonicals` array
       return { ti };
@@ -252,6 +564,9 @@ namespace zekku {
       }
       if (numNodes < nc) {
         np->nodes[numNodes] = ti;
+        if (ti >= where.size())
+          where.resize(std::max<size_t>(ti + 1, 2 * where.size()));
+        where[ti] = root;
         B bb = gbox(t);
         np->hash ^= BBHash<F>()(bb);
         ++np->nodeCount;
@@ -259,10 +574,10 @@ namespace zekku {
       } else if (np->hash != 0 && !isLink && !forceHere) {
         // Leaf is full!
         // Split into multiple trees.
-        I nw = createNode();
-        I ne = createNode();
-        I sw = createNode();
-        I se = createNode();
+        I nw = createNode(root, box.nw());
+        I ne = createNode(root, box.ne());
+        I sw = createNode(root, box.sw());
+        I se = createNode(root, box.se());
         np = &nodes.get(root);
         np->children[0] = nw;
         np->children[1] = ne;
@@ -276,13 +591,14 @@ namespace zekku {
         // we have a false positive of the above,
         // or forceHere is true
         // (in which case isNowhere might be true as well)
-        I nw = createNode(); // Create a node for overflow
+        I nw = createNode(root, box); // Create a node for overflow
         np = &nodes.get(root);
         Node& nwNode = nodes.get(nw);
         // Transfer children from *np to nw (if any)
         if (isNowhere) {
           nwNode.stem = true;
           memcpy(nwNode.children, np->children, 4 * sizeof(I));
+          for (I child : nwNode.children) nodes.get(child).parent = nw;
         }
         np->children[0] = nw;
         np->link = true;
@@ -298,7 +614,7 @@ namespace zekku {
         const Q& shape, std::vector<BBHandle>& out,
         I root, AABB<F> box) const {
       // Abort if the query shape doesn't intersect the box
-      if (!shape.intersects(box)) return;
+      if (!shape.intersects(bounds(box))) return;
       const Node* np = &(nodes.get(root));
       while (np->link) {
         for (I i = 0; i < nc; ++i) {
@@ -328,6 +644,114 @@ namespace zekku {
           out.push_back({ ni });
       }
     }
+    template<typename V>
+    void forEachInChain(I node, V visit) const {
+      const Node* np = &nodes.get(node);
+      while (true) {
+        I count = np->link ? (I) nc : np->nodeCount;
+        for (I i = 0; i < count; ++i) visit(np->nodes[i]);
+        if (!np->link) return;
+        np = &nodes.get(np->children[0]);
+      }
+    }
+    // Reports the pairs between the subtrees at a (here) and b (in
+    // other) by splitting whichever of the two is bigger: its own
+    // elements are looked up in the other subtree, and then each of its
+    // children is joined with the other subtree.
+    template<typename Other, typename J, typename C>
+    void joinNodes(
+        I a, const Other& other, J b,
+        std::vector<BBHandle>& scratch, C& callback) const {
+      const AABB<F>& ab = nodes.get(a).box;
+      const AABB<F>& bb = other.nodes.get(b).box;
+      AABB<F> al = bounds(ab), bl = other.bounds(bb);
+      if (!al.intersects(bl)) return;
+      const Node& at = nodes.get(tailOf(a));
+      const auto& bt = other.nodes.get(other.tailOf(b));
+      if (!at.stem && !bt.stem) {
+        forEachInChain(a, [&](uint32_t ti) {
+          const T& x = canonicals.get(ti);
+          B p = gbox(x);
+          if (!p.intersects(bl)) return;
+          other.forEachInChain(b, [&](uint32_t ui) {
+            const auto& y = other.canonicals.get(ui);
+            if (p.intersects(other.gbox(y))) callback(x, y);
+          });
+        });
+      } else if (at.stem && (!bt.stem || ab.s.x + ab.s.y >= bb.s.x + bb.s.y)) {
+        forEachInChain(a, [&](uint32_t ti) {
+          const T& x = canonicals.get(ti);
+          B p = gbox(x);
+          if (!p.intersects(bl)) return;
+          scratch.clear();
+          other.query(p, scratch, b, bb);
+          for (BBHandle h : scratch) callback(x, other.canonicals.get(h.index));
+        });
+        for (I child : at.children)
+          joinNodes(child, other, b, scratch, callback);
+      } else {
+        other.forEachInChain(b, [&](uint32_t ui) {
+          const auto& y = other.canonicals.get(ui);
+          auto q = other.gbox(y);
+          if (!q.intersects(al)) return;
+          scratch.clear();
+          query(q, scratch, a, ab);
+          for (BBHandle h : scratch) callback(canonicals.get(h.index), y);
+        });
+        for (J child : bt.children)
+          joinNodes(a, other, child, scratch, callback);
+      }
+    }
+    struct PairEntry {
+      const T* t;
+      B box;
+    };
+    // Reports the pairs in the subtree at node, where stack[lo, end) are
+    // the elements above it whose boxes intersect its own
+    template<typename C>
+    void pairs(
+        I node, size_t lo, std::vector<PairEntry>& stack,
+        std::vector<BBHandle>& scratch, C& callback) const {
+      size_t mine = stack.size();
+      const Node* np = &nodes.get(node);
+      while (true) {
+        I count = np->link ? (I) nc : np->nodeCount;
+        for (I i = 0; i < count; ++i) {
+          const T& t = canonicals.get(np->nodes[i]);
+          B p = gbox(t);
+          for (size_t j = lo; j < stack.size(); ++j) {
+            if (p.intersects(stack[j].box)) callback(*stack[j].t, t);
+          }
+          stack.push_back({&t, p});
+        }
+        if (!np->link) break;
+        np = &nodes.get(np->children[0]);
+      }
+      if (np->stem) {
+        size_t end = stack.size();
+        for (I child : np->children) {
+          const Node& cn = nodes.get(child);
+          if (!cn.link && !cn.stem && cn.nodeCount == 0) continue;
+          size_t start = stack.size();
+          AABB<F> cb = bounds(cn.box);
+          for (size_t j = lo; j < end; ++j) {
+            PairEntry e = stack[j];
+            if (e.box.intersects(cb)) stack.push_back(e);
+          }
+          pairs(child, start, stack, scratch, callback);
+          stack.resize(start);
+        }
+        if (loose()) {
+          for (uint32_t i = 0; i < 4; ++i) {
+            for (uint32_t j = i + 1; j < 4; ++j) {
+              joinNodes(np->children[i], *this, np->children[j],
+                scratch, callback);
+            }
+          }
+        }
+      }
+      stack.resize(mine);
+    }
     // Stuff for dumping
     static void indent(size_t n) {
       for (size_t i = 0; i < n; ++i) std::cerr << ' ';
@@ -415,6 +839,19 @@ namespace zekku {
       delete[] handlesAlt;
     }
   };
+  /*
+    Calls callback(a, b) for each element a of ta and b of tb whose boxes
+    intersect, walking both trees at once and skipping pairs of nodes
+    whose boxes don't meet, instead of querying tb once for each element
+    of ta. The trees can hold different types with different GetBB
+    and boxes, but have to use the same F; their shapes need
+    intersects with each other.
+  */
+  template<typename TreeA, typename TreeB, typename C>
+  void join(const TreeA& ta, const TreeB& tb, C callback) {
+    std::vector<BBHandle> scratch;
+    ta.joinNodes(ta.root, tb, tb.root, scratch, callback);
+  }
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,217 @@
+#pragma once
+
+#ifndef ZEKKU_CONCURRENTPOOL_H
+#define ZEKKU_CONCURRENTPOOL_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+#include <cstddef>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+#include "zekku/base.h"
+#include "zekku/bitwise.h"
+#include "zekku/Pool.h"
+
+namespace zekku {
+  /*
+    A memory pool that several threads can allocate from at once.
+    Elements live in fixed-size blocks that are never moved, reached
+    through a block directory whose size is fixed at construction,
+    so `get` needs no locking.
+    Each thread allocates through its own `Cache`, which holds a batch
+    of free handles; the shared free list (and the mutex guarding it)
+    is only touched once per batch.
+    `get` on a handle is safe as long as the handle was obtained in a
+    way that synchronises with its allocation (e.g. from the same thread,
+    or passed through a queue). Iteration and `size` are only exact when
+    no other thread is allocating or deallocating.
+  */
+  template<typename T, size_t blockBits = 12>
+  class ConcurrentPool {
+  public:
+    static constexpr size_t BLOCK_SIZE = (size_t) 1 << blockBits;
+    static constexpr size_t BATCH_SIZE = OCC_BITS;
+    static_assert(BLOCK_SIZE >= OCC_BITS,
+      "Your blocks are smaller than an occupancy word, dum dum!");
+    // Blocks come from malloc, which doesn't align them any further
+    static_assert(alignof(T) <= alignof(std::max_align_t),
+      "Your T is over-aligned, dum dum!");
+    // A thread's batch of free handles. Destroying it hands them back to
+    // the pool, so it must not outlive the pool.
+    class Cache {
+    public:
+      Cache(ConcurrentPool& p) : p(&p) {}
+      ~Cache() {
+        if (!handles.empty()) p->returnHandles(handles, handles.size());
+      }
+      Cache(const Cache& other) = delete;
+      Cache& operator=(const Cache& other) = delete;
+    private:
+      ConcurrentPool* p;
+      std::vector<size_t> handles;
+      friend class ConcurrentPool;
+    };
+    ConcurrentPool(size_t maxCapacity = (size_t) 1 << 24) :
+        maxBlocks((maxCapacity + BLOCK_SIZE - 1) >> blockBits),
+        blocks(new Block*[maxBlocks]), nBlocks(0) {}
+    ~ConcurrentPool() {
+      size_t nb = nBlocks.load(std::memory_order_acquire);
+      for (size_t b = 0; b < nb; ++b) {
+        Block* block = blocks[b];
+        freeBlock(block);
+      }
+      delete[] blocks;
+    }
+    ConcurrentPool(const ConcurrentPool& other) = delete;
+    ConcurrentPool& operator=(const ConcurrentPool& other) = delete;
+    T& get(size_t handle) {
+      return blocks[handle >> blockBits]->elems()[handle & (BLOCK_SIZE - 1)];
+    }
+    const T& get(size_t handle) const {
+      return blocks[handle >> blockBits]->elems()[handle & (BLOCK_SIZE - 1)];
+    }
+    template<typename... Args>
+    size_t allocate(Cache& c, Args&&... args) {
+      if (c.handles.empty()) takeHandles(c.handles);
+      size_t bucket = c.handles.back();
+      c.handles.pop_back();
+      new(&get(bucket)) T(std::forward<Args>(args)...);
+      occWord(bucket).fetch_or(
+        occBit(bucket), std::memory_order_release);
+      return bucket;
+    }
+    void deallocate(Cache& c, size_t handle) {
+      get(handle).~T();
+      occWord(handle).fetch_and(
+        ~occBit(handle), std::memory_order_release);
+      c.handles.push_back(handle);
+      // Give a batch back if this thread is hoarding free handles
+      if (c.handles.size() >= 2 * BATCH_SIZE)
+        returnHandles(c.handles, BATCH_SIZE);
+    }
+    bool isValid(size_t handle) const {
+      if ((handle >> blockBits) >= nBlocks.load(std::memory_order_acquire))
+        return false;
+      return (occWord(handle).load(std::memory_order_acquire) &
+        occBit(handle)) != 0;
+    }
+    size_t size() const {
+      size_t s = 0;
+      size_t nb = nBlocks.load(std::memory_order_acquire);
+      for (size_t b = 0; b < nb; ++b) {
+        for (size_t w = 0; w < occWords(BLOCK_SIZE); ++w)
+          s += popcount64(blocks[b]->occ[w].load(std::memory_order_relaxed));
+      }
+      return s;
+    }
+    size_t getCapacity() const {
+      return nBlocks.load(std::memory_order_acquire) << blockBits;
+    }
+    struct iterator {
+      ConcurrentPool* p;
+      size_t i;
+      bool operator==(const iterator& other) {
+        return p == other.p && i == other.i;
+      }
+      bool operator!=(const iterator& other) {
+        return !(*this == other);
+      }
+      iterator operator++(int) {
+        iterator ip = *this;
+        ++(*this);
+        return ip;
+      }
+      iterator& operator++() {
+        i = p->next(i + 1);
+        return *this;
+      }
+      T& operator*() { return p->get(i); }
+      const T& operator*() const { return p->get(i); }
+    };
+    iterator begin() { return { this, next(0) }; }
+    iterator end()   { return { this, getCapacity() }; }
+  private:
+    struct Block {
+      std::atomic<uint64_t> occ[BLOCK_SIZE >> OCC_SHIFT];
+      typename std::aligned_storage<sizeof(T), alignof(T)>::type
+        storage[BLOCK_SIZE];
+      T* elems() { return reinterpret_cast<T*>(storage); }
+      const T* elems() const { return reinterpret_cast<const T*>(storage); }
+    };
+    size_t maxBlocks;
+    Block** blocks;
+    std::atomic<size_t> nBlocks;
+    std::mutex m; // Guards freeHandles and the creation of blocks
+    std::vector<size_t> freeHandles;
+    std::atomic<uint64_t>& occWord(size_t handle) {
+      return blocks[handle >> blockBits]->
+        occ[(handle & (BLOCK_SIZE - 1)) >> OCC_SHIFT];
+    }
+    const std::atomic<uint64_t>& occWord(size_t handle) const {
+      return blocks[handle >> blockBits]->
+        occ[(handle & (BLOCK_SIZE - 1)) >> OCC_SHIFT];
+    }
+    static uint64_t occBit(size_t handle) {
+      return (uint64_t) 1 << (handle & (OCC_BITS - 1));
+    }
+    size_t next(size_t i) {
+      size_t cap = getCapacity();
+      while (i < cap) {
+        uint64_t bits = occWord(i).load(std::memory_order_acquire) &
+          (~(uint64_t) 0 << (i & (OCC_BITS - 1)));
+        if (bits != 0) return (i & ~(OCC_BITS - 1)) + ctz64(bits);
+        i = (i & ~(OCC_BITS - 1)) + OCC_BITS;
+      }
+      return cap;
+    }
+    // Refill a thread's cache from the shared free list,
+    // creating a new block if that is empty.
+    void takeHandles(std::vector<size_t>& out) {
+      std::lock_guard<std::mutex> lock(m);
+      if (freeHandles.empty()) addBlock();
+      size_t n = freeHandles.size();
+      if (n > BATCH_SIZE) n = BATCH_SIZE;
+      out.insert(out.end(), freeHandles.end() - n, freeHandles.end());
+      freeHandles.resize(freeHandles.size() - n);
+    }
+    // Move the last n handles of a thread's cache to the shared free list.
+    void returnHandles(std::vector<size_t>& in, size_t n) {
+      std::lock_guard<std::mutex> lock(m);
+      freeHandles.insert(freeHandles.end(), in.end() - n, in.end());
+      in.resize(in.size() - n);
+    }
+    void addBlock() {
+      size_t nb = nBlocks.load(std::memory_order_relaxed);
+      if (nb >= maxBlocks) {
+        std::cerr << "ConcurrentPool is out of blocks (" << maxBlocks;
+        std::cerr << " blocks of " << BLOCK_SIZE << " elements)!\n";
+        exit(-1);
+      }
+      Block* block = tmalloc<Block>(1);
+      for (size_t w = 0; w < occWords(BLOCK_SIZE); ++w)
+        new(&block->occ[w]) std::atomic<uint64_t>(0);
+      blocks[nb] = block;
+      nBlocks.store(nb + 1, std::memory_order_release);
+      // Push in reverse so that each batch is one whole occupancy word,
+      // which keeps threads from contending on the same word.
+      size_t base = nb << blockBits;
+      for (size_t i = BLOCK_SIZE; i > 0; --i)
+        freeHandles.push_back(base + i - 1);
+    }
+    void freeBlock(Block* block) {
+      for (size_t w = 0; w < occWords(BLOCK_SIZE); ++w) {
+        uint64_t bits = block->occ[w].load(std::memory_order_relaxed);
+        while (bits != 0) {
+          block->elems()[(w << OCC_SHIFT) + ctz64(bits)].~T();
+          bits &= bits - 1;
+        }
+      }
+      ::free(block);
+    }
+  };
+}
+#endif
@@ -0,0 +1,268 @@
+#pragma once
+
+#ifndef ZEKKU_LINEAR_QUADTREE_H
+#define ZEKKU_LINEAR_QUADTREE_H
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <glm/glm.hpp>
+#include "zekku/base.h"
+#include "zekku/bitwise.h"
+#include "zekku/geometry.h"
+#include "zekku/QuadTree.h"
+#include "zekku/simd.h"
+
+namespace zekku {
+  // Levels in a LinearQuadTree key (two bits each)
+  constexpr size_t LINEAR_QUADTREE_DEPTH = 16;
+  // The interior index has at most 4 ** this many cells
+  constexpr size_t LINEAR_QUADTREE_INDEX_LEVELS = 8;
+  /*
+    Pointerless point quadtree. The elements live in one array sorted by
+    the Morton key of their position, so each cell of the tree is a
+    contiguous run of it, and a query is a few binary searches plus scans.
+    The top levels of the tree are replaced by a table of where each cell
+    at one level starts (the interior index).
+    Keys are made one quadrant digit at a time with AABB::getClass, so this
+    agrees with QuadTree about which side of a boundary a point is on.
+    Elements are referred to by their index in the sorted array.
+    The tree is static: call build again when the elements change. build
+    grows the box (doubling it, as QuadTree does) to fit every element.
+  */
+  template<
+    typename T,
+    typename F = float,
+    size_t nc = QUADTREE_NODE_COUNT,
+    typename GetXY = DefaultGetXY<T, F>
+  >
+  class LinearQuadTree {
+  public:
+    static_assert(std::numeric_limits<F>::is_specialized,
+      "Your F is not a number, dum dum!");
+    using Key = uint32_t;
+    using HandleType = size_t;
+    template<typename... Args>
+    LinearQuadTree(const AABB<F>& box, Args&&... args) :
+        box(box), indexLevel(0), gxy(args...) {
+      clear();
+    }
+    // Replaces the contents of the tree with the elements in [begin, end),
+    // which must be random access iterators. Elements with the same key
+    // stay in the order they were given in. The box is grown first if
+    // some of them are outside it.
+    template<typename It>
+    void build(It begin, It end) {
+      size_t count = (size_t) (end - begin);
+      if (count > std::numeric_limits<uint32_t>::max()) {
+        std::cerr << "Too many elements for a LinearQuadTree!\n";
+        exit(-1);
+      }
+      std::vector<glm::tvec2<F>> positions(count);
+      std::vector<std::pair<Key, size_t>> order(count);
+      for (size_t i = 0; i < count; ++i) {
+        positions[i] = gxy(begin[i]);
+        growToFit(positions[i]);
+      }
+      for (size_t i = 0; i < count; ++i)
+        order[i] = {keyOf(positions[i]), i};
+      std::sort(order.begin(), order.end());
+      keys.resize(count);
+      elems.clear();
+      elems.reserve(count);
+      // Padded so that LeafKernel can read whole vectors from anywhere
+      xs.assign(count + LEAF_LANES, F{0});
+      ys.assign(count + LEAF_LANES, F{0});
+      for (size_t j = 0; j < count; ++j) {
+        size_t i = order[j].second;
+        keys[j] = order[j].first;
+        elems.push_back(begin[i]);
+        xs[j] = positions[i].x;
+        ys[j] = positions[i].y;
+      }
+      buildIndex();
+    }
+    void clear() {
+      keys.clear();
+      elems.clear();
+      xs.assign(LEAF_LANES, F{0});
+      ys.assign(LEAF_LANES, F{0});
+      indexLevel = 0;
+      starts.assign(2, 0);
+    }
+    size_t size() const { return elems.size(); }
+    const AABB<F>& getBox() const { return box; }
+    const T& deref(size_t i) const { return elems[i]; }
+    // Don't move an element through this; build the tree again instead.
+    T& deref(size_t i) { return elems[i]; }
+    // Where p goes in the tree: quadrant digits from the root down,
+    // NW, NE, SW, SE being 0 to 3.
+    Key keyOf(glm::tvec2<F> p) const {
+      return mortonKey(box, p, LINEAR_QUADTREE_DEPTH);
+    }
+    // The query methods work as in QuadTree, but with indices for handles.
+    // They can be run from many threads at once.
+    template<typename Q = AABB<T>>
+    void query(const Q& shape, std::vector<size_t>& out) const {
+      auto visit = [&out](size_t i) {
+        out.push_back(i);
+        return Traversal::CONTINUE;
+      };
+      traverse(shape, visit);
+    }
+    template<typename Q = AABB<T>, typename C>
+    bool query(const Q& shape, C callback) const {
+      auto visit = [this, &callback](size_t i) {
+        return callVisitor(callback, elems[i]);
+      };
+      return traverse(shape, visit);
+    }
+    template<typename Q = AABB<T>, typename C>
+    bool querym(const Q& shape, C callback) {
+      auto visit = [this, &callback](size_t i) {
+        return callVisitor(callback, elems[i]);
+      };
+      return traverse(shape, visit);
+    }
+    template<typename Q = AABB<T>>
+    bool queryFirst(const Q& shape, size_t& out) const {
+      auto visit = [&out](size_t i) {
+        out = i;
+        return Traversal::STOP;
+      };
+      return !traverse(shape, visit);
+    }
+    // Bytes held by the tree's arrays
+    size_t memoryUsage() const {
+      return
+        keys.capacity() * sizeof(Key) +
+        elems.capacity() * sizeof(T) +
+        (xs.capacity() + ys.capacity()) * sizeof(F) +
+        starts.capacity() * sizeof(uint32_t);
+    }
+  private:
+    std::vector<Key> keys;
+    std::vector<T> elems;
+    std::vector<F> xs, ys;
+    // starts[c] is the index of the first element in cell c of level
+    // indexLevel (in Morton order), and starts[4 ** indexLevel] is size().
+    std::vector<uint32_t> starts;
+    AABB<F> box;
+    size_t indexLevel;
+    ZK_NOUNIQADDR GetXY gxy;
+    // Doubles the box toward p until it contains p, at most
+    // QUADTREE_MAX_GROWTH times. The keys are all made after this, so the
+    // old box doesn't have to come out as an exact quadrant.
+    void growToFit(glm::tvec2<F> p) {
+      for (size_t i = 0; !box.contains(p); ++i) {
+        if (i == QUADTREE_MAX_GROWTH) {
+          std::cerr << "(" << p[0] << ", " << p[1] << ") is out of range!\n";
+          std::cerr << "Box is centred at (" << box.c[0] << ", " << box.c[1] << ") ";
+          std::cerr << "with w = " << box.s[0] << " and h = " << box.s[1] << "\n";
+          exit(-1);
+        }
+        uint32_t q;
+        box = growToward(box, p, q);
+      }
+    }
+    // Shift that takes a key to its cell at a level
+    static size_t shiftAt(size_t level) {
+      return 2 * (LINEAR_QUADTREE_DEPTH - level);
+    }
+    // (Shifting a 32-bit key by 32 would be undefined.)
+    static Key cellOf(Key k, size_t shift) {
+      return shift >= 32 ? 0 : k >> shift;
+    }
+    // Index just deep enough for cells to hold about nc / 2 elements
+    void buildIndex() {
+      size_t count = keys.size();
+      indexLevel = 0;
+      while (indexLevel < LINEAR_QUADTREE_INDEX_LEVELS &&
+          (count >> (2 * indexLevel)) > nc / 2)
+        ++indexLevel;
+      size_t cells = size_t(1) << (2 * indexLevel);
+      size_t shift = shiftAt(indexLevel);
+      starts.resize(cells + 1);
+      size_t i = 0;
+      for (size_t c = 0; c <= cells; ++c) {
+        while (i < count && cellOf(keys[i], shift) < c) ++i;
+        starts[c] = (uint32_t) i;
+      }
+    }
+    // Where child c of the cell with the given key prefix starts,
+    // somewhere in [lo, hi)
+    size_t childStart(
+        Key prefix, size_t level, uint32_t c, size_t lo, size_t hi) const {
+      Key first = ((prefix << 2) | c) << shiftAt(level + 1);
+      if (level < indexLevel) return starts[first >> shiftAt(indexLevel)];
+      return (size_t) (std::lower_bound(
+        keys.begin() + lo, keys.begin() + hi, first) - keys.begin());
+    }
+    struct CellEntry {
+      AABB<F> box;
+      size_t lo, hi; // The elements in the cell
+      Key prefix;
+      size_t level;
+    };
+    // A cell is replaced by at most four children, one level down, so the
+    // stack of cells to visit never gets bigger than this
+    static constexpr size_t CELL_STACK_SIZE = 3 * LINEAR_QUADTREE_DEPTH + 1;
+    // Visits the elements in shape, in Morton order. Cells small enough
+    // are scanned in one go; otherwise their children are visited.
+    // This walks an explicit stack rather than recursing, so that the
+    // whole walk (shape tests and leaf kernel included) can be inlined
+    // into the query, as QuadTree's is.
+    template<typename Q, typename V>
+    bool traverse(const Q& shape, V& visit) const {
+      CellEntry stack[CELL_STACK_SIZE];
+      size_t size = 0;
+      if (!elems.empty() && shape.intersects(box))
+        stack[size++] = {box, 0, elems.size(), 0, 0};
+      while (size != 0) {
+        CellEntry e = stack[--size];
+        if (e.hi - e.lo <= nc || e.level == LINEAR_QUADTREE_DEPTH) {
+          if (!scan(shape, e.lo, e.hi, visit)) return false;
+          continue;
+        }
+        size_t bounds[5] = {e.lo, 0, 0, 0, e.hi};
+        for (uint32_t c = 1; c < 4; ++c)
+          bounds[c] = childStart(e.prefix, e.level, c, e.lo, e.hi);
+        glm::tvec2<F> h = e.box.s * oneHalf<F>;
+        // Pushed in reverse so that NW comes off first
+        for (uint32_t c = 4; c > 0; --c) {
+          uint32_t k = c - 1;
+          if (bounds[k] == bounds[k + 1]) continue;
+          AABB<F> sub = {{
+            (k & 1) != 0 ? e.box.c.x + h.x : e.box.c.x - h.x,
+            (k & 2) != 0 ? e.box.c.y + h.y : e.box.c.y - h.y,
+          }, h};
+          if (!shape.intersects(sub)) continue;
+          stack[size++] = {
+            sub, bounds[k], bounds[k + 1], (e.prefix << 2) | k, e.level + 1
+          };
+        }
+      }
+      return true;
+    }
+    template<typename Q, typename V>
+    bool scan(const Q& shape, size_t lo, size_t hi, V& visit) const {
+      for (size_t base = lo; base < hi; base += 64) {
+        size_t k = hi - base < 64 ? hi - base : 64;
+        uint64_t m = LeafKernel<Q, F>::mask(
+          shape, xs.data() + base, ys.data() + base, k);
+        while (m != 0) {
+          size_t i = base + ctz64(m);
+          m &= m - 1;
+          if (visit(i) == Traversal::STOP) return false;
+        }
+      }
+      return true;
+    }
+  };
+}
+
+#endif
@@ -3,12 +3,17 @@
 #ifndef ZEKKU_POOL_H
 #define ZEKKU_POOL_H
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <algorithm>
 #include <random>
 #include <type_traits>
+#include <vector>
+#include "zekku/allocator.h"
+#include "zekku/base.h"
+#include "zekku/bitwise.h"
 
 namespace zekku {
   template<typename T>
@@ -20,84 +25,595 @@ namespace zekku {
     return (T*) ::realloc(p, elems * sizeof(T));
   }
   // ------------------
+  // Occupancy of a pool is kept as a bitset, one bit per slot,
+  // packed into 64-bit words.
+  constexpr size_t OCC_BITS = 64;
+  constexpr size_t OCC_SHIFT = 6;
+  inline size_t occWords(size_t capacity) {
+    return capacity >> OCC_SHIFT;
+  }
+  inline bool occTest(const uint64_t* occupied, size_t i) {
+    return (occupied[i >> OCC_SHIFT] >> (i & (OCC_BITS - 1))) & 1;
+  }
+  inline void occSet(uint64_t* occupied, size_t i) {
+    occupied[i >> OCC_SHIFT] |= (uint64_t) 1 << (i & (OCC_BITS - 1));
+  }
+  inline void occReset(uint64_t* occupied, size_t i) {
+    occupied[i >> OCC_SHIFT] &= ~((uint64_t) 1 << (i & (OCC_BITS - 1)));
+  }
+  // Sets the bits for slots [lo, hi), a word at a time.
+  inline void occSetRange(uint64_t* occupied, size_t lo, size_t hi) {
+    size_t w = lo >> OCC_SHIFT;
+    size_t last = (hi - 1) >> OCC_SHIFT;
+    uint64_t first = ~(uint64_t) 0 << (lo & (OCC_BITS - 1));
+    uint64_t end =
+      ~(uint64_t) 0 >> (OCC_BITS - 1 - ((hi - 1) & (OCC_BITS - 1)));
+    if (w == last) {
+      occupied[w] |= first & end;
+      return;
+    }
+    occupied[w] |= first;
+    while (++w < last) occupied[w] = ~(uint64_t) 0;
+    occupied[last] |= end;
+  }
+  // Clears the bits for slots [lo, hi), a word at a time.
+  inline void occResetRange(uint64_t* occupied, size_t lo, size_t hi) {
+    size_t w = lo >> OCC_SHIFT;
+    size_t last = (hi - 1) >> OCC_SHIFT;
+    uint64_t first = ~(uint64_t) 0 << (lo & (OCC_BITS - 1));
+    uint64_t end =
+      ~(uint64_t) 0 >> (OCC_BITS - 1 - ((hi - 1) & (OCC_BITS - 1)));
+    if (w == last) {
+      occupied[w] &= ~(first & end);
+      return;
+    }
+    occupied[w] &= ~first;
+    while (++w < last) occupied[w] = 0;
+    occupied[last] &= ~end;
+  }
+  // Returns the first occupied slot at or after i, or capacity if none.
+  inline size_t occNext(const uint64_t* occupied, size_t i, size_t capacity) {
+    if (i >= capacity) return capacity;
+    size_t w = i >> OCC_SHIFT;
+    uint64_t bits = occupied[w] & (~(uint64_t) 0 << (i & (OCC_BITS - 1)));
+    size_t words = occWords(capacity);
+    while (bits == 0) {
+      if (++w >= words) return capacity;
+      bits = occupied[w];
+    }
+    return (w << OCC_SHIFT) + ctz64(bits);
+  }
+  // Returns the last occupied slot at or before i, or 0 if none.
+  inline size_t occPrev(const uint64_t* occupied, size_t i) {
+    size_t w = i >> OCC_SHIFT;
+    uint64_t bits = occupied[w] &
+      (~(uint64_t) 0 >> (OCC_BITS - 1 - (i & (OCC_BITS - 1))));
+    while (bits == 0) {
+      if (w == 0) return 0;
+      bits = occupied[--w];
+    }
+    return (w << OCC_SHIFT) + highestBit64(bits);
+  }
+  // ------------------
   // Helper methods for destroying array
   // This is a bit confusing. Basically, the first overload is called
   // if T is not trivially destructible, and the second otherwise.
-  template<typename T,
+  template<typename T, typename S,
     typename std::enable_if<
       !std::is_trivially_destructible<T>::value, int>::type = 0>
-  void freeElems(T* elems, bool* allocated, size_t size) {
-    for (size_t i = 0; i < size; ++i) {
-      if (!allocated[i]) {
-        elems[i].~T();
+  void freeElems(S& elems, const uint64_t* occupied, size_t size) {
+    size_t words = occWords(size);
+    for (size_t w = 0; w < words; ++w) {
+      uint64_t bits = occupied[w];
+      while (bits != 0) {
+        elems.get((w << OCC_SHIFT) + ctz64(bits)).~T();
+        bits &= bits - 1;
       }
     }
   }
-  template<typename T,
+  template<typename T, typename S,
     typename std::enable_if<
       std::is_trivially_destructible<T>::value, int>::type = 0>
-  void freeElems(T* /*elems*/, bool* /*allocated*/, size_t /*size*/) {}
+  void freeElems(S& /*elems*/, const uint64_t* /*occupied*/, size_t /*size*/) {}
+  // ------------------
+  // Allocation policies for Pool.
+  // A policy decides which free slot a new element goes into and when
+  // the pool has to grow. Its state can be saved to and loaded from
+  // a byte buffer (stateSize / saveState / loadState) for snapshots;
+  // canLoadState says whether a saved state of some size fits a pool
+  // with the given capacity and number of elements.
+  // Assigns handles randomly, with linear probing. Doubles at 75% load.
+  struct RandomProbe {
+    RandomProbe() { r.seed(time(nullptr)); }
+    void reset(size_t /*capacity*/) {}
+    void grow(size_t /*oldCapacity*/, size_t /*newCapacity*/) {}
+    void rebuild(const uint64_t* /*occupied*/, size_t /*capacity*/) {}
+    bool shouldExpand(size_t filled, size_t capacity) const {
+      return filled * 4 >= capacity * 3;
+    }
+    size_t pick(const uint64_t* occupied, size_t capacity) {
+      size_t bucket = r() & (capacity - 1);
+      // Probe a word at a time instead of a slot at a time
+      size_t w = bucket >> OCC_SHIFT;
+      uint64_t free =
+        ~occupied[w] & (~(uint64_t) 0 << (bucket & (OCC_BITS - 1)));
+      size_t words = occWords(capacity);
+      while (free == 0) {
+        if (++w >= words) w = 0;
+        free = ~occupied[w];
+      }
+      return (w << OCC_SHIFT) + ctz64(free);
+    }
+    // Takes whole runs of free slots after a random starting point.
+    // There must be at least count free slots.
+    void pickN(
+        const uint64_t* occupied, size_t capacity,
+        size_t count, size_t* out) {
+      size_t bucket = r() & (capacity - 1);
+      size_t w = bucket >> OCC_SHIFT;
+      uint64_t free =
+        ~occupied[w] & (~(uint64_t) 0 << (bucket & (OCC_BITS - 1)));
+      size_t words = occWords(capacity);
+      while (true) {
+        while (free != 0) {
+          *out++ = (w << OCC_SHIFT) + ctz64(free);
+          if (--count == 0) return;
+          free &= free - 1;
+        }
+        if (++w >= words) w = 0;
+        free = ~occupied[w];
+      }
+    }
+    void release(size_t /*handle*/) {}
+    void releaseN(const size_t* /*handles*/, size_t /*count*/) {}
+    size_t stateSize() const { return sizeof(r); }
+    static bool canLoadState(
+        size_t bytes, size_t /*capacity*/, size_t /*filled*/) {
+      return bytes == sizeof(r);
+    }
+    void saveState(void* out) const {
+      memcpy(out, (const void*) &r, sizeof(r));
+    }
+    void loadState(const void* in, size_t /*bytes*/) {
+      memcpy((void*) &r, in, sizeof(r));
+    }
+    static_assert(std::is_trivially_copyable<std::minstd_rand>::value,
+      "Your RNG is not trivially copyable, dum dum!");
+    std::minstd_rand r;
+  };
+  // Keeps a stack of free slots, so allocation and deallocation are O(1)
+  // and the handles handed out depend only on the sequence of calls:
+  // a fresh pool returns 0, 1, 2, ... and the most recently freed handle
+  // is reused first. Doubles only when completely full.
+  struct FreeList {
+    void reset(size_t capacity) {
+      freeSlots.clear();
+      grow(0, capacity);
+    }
+    void grow(size_t oldCapacity, size_t newCapacity) {
+      // The new slots go under any that are still free, in reverse so
+      // that the lowest handle is popped first
+      std::vector<size_t> slots;
+      slots.reserve(newCapacity - oldCapacity + freeSlots.size());
+      for (size_t i = newCapacity; i > oldCapacity; --i)
+        slots.push_back(i - 1);
+      slots.insert(slots.end(), freeSlots.begin(), freeSlots.end());
+      freeSlots.swap(slots);
+    }
+    // Recreate the stack after the occupancy has been rearranged.
+    void rebuild(const uint64_t* occupied, size_t capacity) {
+      freeSlots.clear();
+      for (size_t i = capacity; i > 0; --i) {
+        if (!occTest(occupied, i - 1)) freeSlots.push_back(i - 1);
+      }
+    }
+    bool shouldExpand(size_t filled, size_t capacity) const {
+      return filled >= capacity;
+    }
+    size_t pick(const uint64_t* /*occupied*/, size_t /*capacity*/) {
+      size_t bucket = freeSlots.back();
+      freeSlots.pop_back();
+      return bucket;
+    }
+    void pickN(
+        const uint64_t* /*occupied*/, size_t /*capacity*/,
+        size_t count, size_t* out) {
+      std::reverse_copy(freeSlots.end() - count, freeSlots.end(), out);
+      freeSlots.resize(freeSlots.size() - count);
+    }
+    void release(size_t handle) {
+      freeSlots.push_back(handle);
+    }
+    // Pushes the handles in reverse, so that pickN hands them out again
+    // in the same order
+    void releaseN(const size_t* handles, size_t count) {
+      size_t top = freeSlots.size();
+      freeSlots.resize(top + count);
+      std::reverse_copy(handles, handles + count, freeSlots.begin() + top);
+    }
+    size_t stateSize() const { return freeSlots.size() * sizeof(size_t); }
+    // There is one entry for every free slot
+    static bool canLoadState(size_t bytes, size_t capacity, size_t filled) {
+      return bytes == (capacity - filled) * sizeof(size_t);
+    }
+    void saveState(void* out) const {
+      if (!freeSlots.empty())
+        memcpy(out, freeSlots.data(), freeSlots.size() * sizeof(size_t));
+    }
+    void loadState(const void* in, size_t bytes) {
+      freeSlots.resize(bytes / sizeof(size_t));
+      if (!freeSlots.empty()) memcpy(freeSlots.data(), in, bytes);
+    }
+    std::vector<size_t> freeSlots;
+  };
+  // ------------------
+  // Element storage for Pool.
+  // Storage only manages raw memory; Pool constructs and destroys the
+  // elements themselves. saveTo and loadFrom copy the first n slots
+  // bytewise, and are only used for trivially copyable elements.
+  // Keeps every element in one array, which is reallocated when the pool
+  // grows. Growing moves the elements, invalidating references to them.
+  struct FlatStorage {
+    template<typename T, typename Alloc>
+    class Impl {
+    public:
+      Impl(size_t capacity, const Alloc& a) :
+          alloc(a), elems(allocate(capacity)), capacity(capacity) {}
+      ~Impl() { alloc.deallocate(elems, capacity * sizeof(T)); }
+      Impl(Impl&& other) :
+          alloc(other.alloc), elems(other.elems), capacity(other.capacity) {
+        other.elems = nullptr;
+        other.capacity = 0;
+      }
+      Impl& operator=(Impl&& other) {
+        std::swap(alloc, other.alloc);
+        std::swap(elems, other.elems);
+        std::swap(capacity, other.capacity);
+        return *this;
+      }
+      T& get(size_t i) { return elems[i]; }
+      const T& get(size_t i) const { return elems[i]; }
+      const Alloc& getAllocator() const { return alloc; }
+      void saveTo(void* out, size_t n) const {
+        memcpy(out, (const void*) elems, n * sizeof(T));
+      }
+      void loadFrom(const void* in, size_t n) {
+        memcpy((void*) elems, in, n * sizeof(T));
+      }
+      // Live elements must lie below both capacities.
+      void resize(
+          size_t oldCapacity, size_t newCapacity,
+          const uint64_t* occupied) {
+        resize(oldCapacity, newCapacity, occupied,
+          std::is_trivially_copyable<T>());
+        capacity = newCapacity;
+      }
+    private:
+      T* allocate(size_t n) {
+        return (T*) alloc.allocate(n * sizeof(T));
+      }
+      void resize(
+          size_t oldCapacity, size_t newCapacity,
+          const uint64_t* /*occupied*/, std::true_type) {
+        elems = (T*) alloc.reallocate(
+          elems, oldCapacity * sizeof(T), newCapacity * sizeof(T));
+      }
+      // realloc can't be used to move objects that aren't trivially
+      // copyable, so move the live ones over by hand.
+      void resize(
+          size_t oldCapacity, size_t newCapacity,
+          const uint64_t* occupied, std::false_type) {
+        T* newElems = allocate(newCapacity);
+        size_t end = std::min(oldCapacity, newCapacity);
+        for (size_t i = occNext(occupied, 0, end);
+            i < end;
+            i = occNext(occupied, i + 1, end)) {
+          new(newElems + i) T(std::move(elems[i]));
+          elems[i].~T();
+        }
+        alloc.deallocate(elems, oldCapacity * sizeof(T));
+        elems = newElems;
+      }
+      ZK_NOUNIQADDR Alloc alloc;
+      T* elems;
+      size_t capacity;
+    };
+  };
+  // Keeps elements in fixed-size blocks of 2^blockBits elements, found
+  // through a block directory. Growing only allocates new blocks, so
+  // elements never move and references to them stay valid.
+  template<size_t blockBits = 8>
+  struct ChunkedStorage {
+    template<typename T, typename Alloc>
+    class Impl {
+      static_assert(!MapsPerAllocation<Alloc>::value,
+        "Your allocator would map a whole range for every block, dum dum!");
+    public:
+      static constexpr size_t BLOCK_SIZE = (size_t) 1 << blockBits;
+      Impl(size_t capacity, const Alloc& a) : alloc(a) {
+        resize(0, capacity, nullptr);
+      }
+      ~Impl() {
+        for (T* block : blocks) alloc.deallocate(block, BLOCK_BYTES);
+      }
+      Impl(Impl&& other) :
+        alloc(other.alloc), blocks(std::move(other.blocks)) {}
+      Impl& operator=(Impl&& other) {
+        std::swap(alloc, other.alloc);
+        std::swap(blocks, other.blocks);
+        return *this;
+      }
+      T& get(size_t i) {
+        return blocks[i >> blockBits][i & (BLOCK_SIZE - 1)];
+      }
+      const T& get(size_t i) const {
+        return blocks[i >> blockBits][i & (BLOCK_SIZE - 1)];
+      }
+      const Alloc& getAllocator() const { return alloc; }
+      void saveTo(void* out, size_t n) const {
+        for (size_t b = 0; n != 0; ++b) {
+          size_t k = n < BLOCK_SIZE ? n : BLOCK_SIZE;
+          memcpy(out, (const void*) blocks[b], k * sizeof(T));
+          out = (char*) out + k * sizeof(T);
+          n -= k;
+        }
+      }
+      void loadFrom(const void* in, size_t n) {
+        for (size_t b = 0; n != 0; ++b) {
+          size_t k = n < BLOCK_SIZE ? n : BLOCK_SIZE;
+          memcpy((void*) blocks[b], in, k * sizeof(T));
+          in = (const char*) in + k * sizeof(T);
+          n -= k;
+        }
+      }
+      void resize(
+          size_t /*oldCapacity*/, size_t newCapacity,
+          const uint64_t* /*occupied*/) {
+        size_t needed = (newCapacity + BLOCK_SIZE - 1) >> blockBits;
+        while (blocks.size() < needed)
+          blocks.push_back((T*) alloc.allocate(BLOCK_BYTES));
+        while (blocks.size() > needed) {
+          alloc.deallocate(blocks.back(), BLOCK_BYTES);
+          blocks.pop_back();
+        }
+      }
+    private:
+      static constexpr size_t BLOCK_BYTES = BLOCK_SIZE * sizeof(T);
+      ZK_NOUNIQADDR Alloc alloc;
+      std::vector<T*> blocks;
+    };
+  };
   // ------------------
+  // Capacities are powers of two, and at least one occupancy word.
   constexpr size_t START_CAPAT = 64;
-  template<typename T>
+  // The smallest capacity that holds at least c slots
+  inline size_t poolCapacity(size_t c) {
+    size_t capacity = START_CAPAT;
+    while (capacity < c && (capacity << 1) != 0) capacity <<= 1;
+    return capacity;
+  }
+  constexpr size_t NO_HANDLE = (size_t) -1;
+  template<
+    typename T,
+    typename Policy = RandomProbe,
+    typename Storage = FlatStorage,
+    typename Alloc = MallocAllocator
+  >
   class Pool {
   public:
     // static_assert(std::is_trivially_copyable<T>::value,
     //   "Your T is not trivially copyable, dum dum!");
-    Pool(size_t c = START_CAPAT) : filled(0), capacity(c),
-        elems(tmalloc<T>(c)),
-        allocated(tmalloc<bool>(c)) {
-      r.seed(time(nullptr));
-      memset(allocated, 0, c * sizeof(bool));
+    // The allocator provides the memory for the elements themselves;
+    // the occupancy bitset always comes from malloc.
+    Pool(size_t c = START_CAPAT, const Alloc& a = Alloc()) : filled(0),
+        capacity(poolCapacity(c)),
+        elems(capacity, a),
+        occupied(tmalloc<uint64_t>(occWords(capacity))),
+        shrinkDenominator(0), nextShrinkCheck(0) {
+      memset(occupied, 0, occWords(capacity) * sizeof(uint64_t));
+      policy.reset(capacity);
     }
     ~Pool() {
-      freeElems(elems, allocated, capacity);
-      ::free(elems);
-      ::free(allocated);
+      freeElems<T>(elems, occupied, capacity);
+      ::free(occupied);
     }
     Pool(const Pool& other) = delete;
     Pool& operator=(const Pool& other) = delete;
     Pool(Pool&& other) :
         filled(other.filled), capacity(other.capacity),
-        elems(other.elems), allocated(other.allocated) {
-      r.seed(time(nullptr));
+        elems(std::move(other.elems)), occupied(other.occupied),
+        policy(std::move(other.policy)),
+        shrinkDenominator(other.shrinkDenominator),
+        nextShrinkCheck(other.nextShrinkCheck) {
       other.filled = 0;
       other.capacity = START_CAPAT;
-      other.elems = tmalloc<T>(START_CAPAT);
-      other.allocated = tmalloc<bool>(START_CAPAT);
-      memset(other.allocated, 0, START_CAPAT * sizeof(bool));
+      other.elems = Elems(START_CAPAT, elems.getAllocator());
+      other.occupied = tmalloc<uint64_t>(occWords(START_CAPAT));
+      memset(other.occupied, 0, occWords(START_CAPAT) * sizeof(uint64_t));
+      other.policy.reset(START_CAPAT);
     }
     Pool& operator=(Pool&& other) {
       std::swap(filled, other.filled);
       std::swap(capacity, other.capacity);
       std::swap(elems, other.elems);
-      std::swap(allocated, other.allocated);
+      std::swap(occupied, other.occupied);
+      std::swap(policy, other.policy);
+      std::swap(shrinkDenominator, other.shrinkDenominator);
+      std::swap(nextShrinkCheck, other.nextShrinkCheck);
       return *this;
     }
     T& get(size_t handle) {
-      return elems[handle];
+      return elems.get(handle);
     }
     const T& get(size_t handle) const {
-      return elems[handle];
+      return elems.get(handle);
     }
     template<typename... Args>
     size_t allocate(Args&&... args) {
-      if (shouldExpand()) expand();
-      size_t bucket = r() & (capacity - 1);
-      while (allocated[bucket]) {
-        ++bucket;
-        if (bucket >= capacity) bucket -= capacity;
-      }
+      if (policy.shouldExpand(filled, capacity)) expand();
+      size_t bucket = policy.pick(occupied, capacity);
       ++filled;
-      allocated[bucket] = true;
-      new(elems + bucket) T(std::forward<Args>(args)...);
+      occSet(occupied, bucket);
+      new(&elems.get(bucket)) T(std::forward<Args>(args)...);
       return bucket;
     }
     void deallocate(size_t handle) {
-      allocated[handle] = false;
+      elems.get(handle).~T();
+      occReset(occupied, handle);
+      policy.release(handle);
       --filled;
+      if (shrinkDenominator != 0 && filled <= nextShrinkCheck) autoShrink();
+    }
+    // Allocates count elements at once, writing their handles to out.
+    // Each element is constructed from args (which are copied, not
+    // moved); trivial elements with no arguments are zeroed a run of
+    // consecutive slots at a time.
+    template<typename... Args>
+    void allocateN(size_t count, size_t* out, const Args&... args) {
+      if (count == 0) return;
+      while (policy.shouldExpand(filled + count - 1, capacity)) expand();
+      policy.pickN(occupied, capacity, count, out);
+      filled += count;
+      for (size_t i = 0; i < count;) {
+        size_t j = runEnd(out, i, count);
+        occSetRange(occupied, out[i], out[j - 1] + 1);
+        i = j;
+      }
+      constructN(count, out,
+        std::integral_constant<bool,
+          sizeof...(Args) == 0 &&
+          std::is_trivially_default_constructible<T>::value>(),
+        args...);
+    }
+    void deallocateN(const size_t* handles, size_t count) {
+      for (size_t i = 0; i < count;) {
+        size_t j = runEnd(handles, i, count);
+        for (size_t k = i; k < j; ++k) elems.get(handles[k]).~T();
+        occResetRange(occupied, handles[i], handles[j - 1] + 1);
+        i = j;
+      }
+      policy.releaseN(handles, count);
+      filled -= count;
+      if (shrinkDenominator != 0 && filled <= nextShrinkCheck) autoShrink();
+    }
+    // Moves the live elements into slots [0, size()), filling holes with
+    // elements from the end of the pool. Returns a vector mapping each
+    // old handle to its new one (NO_HANDLE for slots that were free), so
+    // that anything storing handles can fix them up in one pass.
+    // If shrink is true, the capacity is then reduced to the smallest
+    // one that can hold the live elements.
+    std::vector<size_t> compact(bool shrink = false) {
+      std::vector<size_t> remap(capacity, NO_HANDLE);
+      size_t lo = 0;
+      size_t hi = capacity;
+      while (true) {
+        // Find the next hole from the front and live element from the back
+        while (lo < filled && occTest(occupied, lo)) {
+          remap[lo] = lo;
+          ++lo;
+        }
+        if (lo >= filled) break;
+        hi = occPrev(occupied, hi - 1);
+        T& src = elems.get(hi);
+        new(&elems.get(lo)) T(std::move(src));
+        src.~T();
+        occSet(occupied, lo);
+        occReset(occupied, hi);
+        remap[hi] = lo;
+        ++lo;
+      }
+      if (!(shrink && trim(0))) policy.rebuild(occupied, capacity);
+      return remap;
+    }
+    // Releases the capacity above the highest live handle, down to the
+    // smallest capacity that the next allocation won't immediately grow.
+    // Unlike compact, this never moves elements, so handles stay valid.
+    void shrinkToFit() {
+      trim(0);
+    }
+    // Makes the pool shrink by itself once no more than 1/denominator of
+    // its capacity is in use (0, the default, turns this off).
+    // Denominators below 4 are rounded up to 4. After shrinking, at most
+    // half of the new capacity is in use, so a pool hovering around the
+    // threshold doesn't keep growing and shrinking.
+    // As with shrinkToFit, only capacity above the highest live handle
+    // can be released.
+    void setAutoShrink(size_t denominator) {
+      shrinkDenominator =
+        denominator == 0 ? 0 : std::max<size_t>(denominator, 4);
+      resetShrinkCheck();
+    }
+    // Snapshots copy the whole state of the pool (elements, occupancy,
+    // and the policy's state) into a flat buffer, so that restoring one
+    // brings back the same handles, and the same handles for future
+    // allocations, in a few memcpys. Only for trivially copyable T.
+    // A snapshot is a plain byte image: it is only meaningful to a pool
+    // of the same type on the same platform.
+    size_t snapshotSize() const {
+      return sizeof(SnapshotHeader) +
+        occWords(capacity) * sizeof(uint64_t) +
+        capacity * sizeof(T) + policy.stateSize();
+    }
+    // Writes snapshotSize() bytes to out, which need not be aligned.
+    // Returns the number of bytes written.
+    size_t snapshot(void* out) const {
+      static_assert(std::is_trivially_copyable<T>::value,
+        "Your T is not trivially copyable, dum dum!");
+      SnapshotHeader h = {
+        sizeof(T), capacity, filled, policy.stateSize()
+      };
+      char* o = (char*) out;
+      memcpy(o, &h, sizeof(h));
+      o += sizeof(h);
+      memcpy(o, occupied, occWords(capacity) * sizeof(uint64_t));
+      o += occWords(capacity) * sizeof(uint64_t);
+      elems.saveTo(o, capacity);
+      o += capacity * sizeof(T);
+      policy.saveState(o);
+      o += h.policyBytes;
+      return (size_t) (o - (char*) out);
+    }
+    // Replaces the contents of this pool with a snapshot of size bytes.
+    // Returns false (leaving the pool untouched) if the buffer is too
+    // short, was written for elements of a different size or holds
+    // policy state of the wrong size.
+    bool restore(const void* in, size_t size) {
+      static_assert(std::is_trivially_copyable<T>::value,
+        "Your T is not trivially copyable, dum dum!");
+      SnapshotHeader h;
+      if (size < sizeof(h)) return false;
+      memcpy(&h, in, sizeof(h));
+      if (h.elemSize != sizeof(T) ||
+          h.capacity != poolCapacity((size_t) h.capacity) ||
+          h.filled > h.capacity)
+        return false;
+      size_t newCapacity = (size_t) h.capacity;
+      size_t occBytes = occWords(newCapacity) * sizeof(uint64_t);
+      if (size - sizeof(h) < occBytes ||
+          (size - sizeof(h) - occBytes) / sizeof(T) < newCapacity ||
+          size - sizeof(h) - occBytes - newCapacity * sizeof(T) <
+            h.policyBytes ||
+          !Policy::canLoadState(
+            (size_t) h.policyBytes, newCapacity, (size_t) h.filled))
+        return false;
+      if (newCapacity != capacity) {
+        elems.resize(capacity, newCapacity, occupied);
+        occupied = trealloc<uint64_t>(occupied, occWords(newCapacity));
+        capacity = newCapacity;
+      }
+      filled = (size_t) h.filled;
+      const char* i = (const char*) in + sizeof(h);
+      memcpy(occupied, i, occBytes);
+      i += occBytes;
+      elems.loadFrom(i, capacity);
+      i += capacity * sizeof(T);
+      policy.loadState(i, (size_t) h.policyBytes);
+      resetShrinkCheck();
+      return true;
+    }
+    bool isValid(size_t handle) const {
+      return handle < capacity && occTest(occupied, handle);
     }
-    bool isValid(size_t handle) { return allocated[handle]; }
     size_t size() const { return filled; }
     size_t getCapacity() const { return capacity; }
     struct iterator {
@@ -119,36 +635,95 @@ namespace zekku {
         --(*this);
         return ip;
       }
+      // Skip straight to the next live slot, a word at a time
       iterator& operator++() {
-        do ++i;
-        while (!p->allocated[i] && i < p->capacity);
+        i = occNext(p->occupied, i + 1, p->capacity);
         return *this;
       }
       iterator& operator--() {
-        do --i;
-        while (!p->allocated[i] && i > 0);
+        if (i > 0) i = occPrev(p->occupied, i - 1);
         return *this;
       }
-      T& operator*() { return p->elems[i]; }
-      const T& operator*() const { return p->elems[i]; }
+      T& operator*() { return p->elems.get(i); }
+      const T& operator*() const { return p->elems.get(i); }
     };
-    iterator begin() { return { this, 0        }; }
+    iterator begin() { return { this, occNext(occupied, 0, capacity) }; }
     iterator end()   { return { this, capacity }; }
   private:
-    bool shouldExpand() {
-      return filled * 4 >= capacity * 3;
+    struct SnapshotHeader {
+      uint64_t elemSize;
+      uint64_t capacity;
+      uint64_t filled;
+      uint64_t policyBytes;
+    };
+    template<typename... Args>
+    void constructN(
+        size_t count, const size_t* handles, std::false_type,
+        const Args&... args) {
+      for (size_t i = 0; i < count; ++i)
+        new(&elems.get(handles[i])) T(args...);
+    }
+    // Returns the end of the run of consecutive handles starting at i
+    static size_t runEnd(const size_t* handles, size_t i, size_t count) {
+      size_t j = i + 1;
+      while (j < count && handles[j] == handles[j - 1] + 1) ++j;
+      return j;
+    }
+    void constructN(size_t count, const size_t* handles, std::true_type) {
+      size_t i = 0;
+      while (i < count) {
+        // Find a run of consecutive handles (in the same storage block)
+        size_t j = i + 1;
+        while (j < count && handles[j] == handles[j - 1] + 1 &&
+            &elems.get(handles[j]) == &elems.get(handles[j - 1]) + 1)
+          ++j;
+        memset((void*) &elems.get(handles[i]), 0, (j - i) * sizeof(T));
+        i = j;
+      }
     }
     void expand() {
-      elems = trealloc<T>(elems, capacity << 1);
-      allocated = trealloc<bool>(allocated, capacity << 1);
-      memset(allocated + capacity, 0, capacity * sizeof(bool));
+      elems.resize(capacity, capacity << 1, occupied);
+      occupied = trealloc<uint64_t>(occupied, occWords(capacity << 1));
+      memset(occupied + occWords(capacity), 0,
+        occWords(capacity) * sizeof(uint64_t));
+      policy.grow(capacity, capacity << 1);
       capacity <<= 1;
+      resetShrinkCheck();
+    }
+    // Shrinks to the smallest capacity that is at least minCapacity,
+    // keeps every live handle and won't grow on the next allocation.
+    // Returns true if the capacity changed.
+    bool trim(size_t minCapacity) {
+      size_t top = filled == 0 ? 0 : occPrev(occupied, capacity - 1) + 1;
+      size_t newCapacity = START_CAPAT;
+      while (newCapacity < top || newCapacity < minCapacity ||
+          policy.shouldExpand(filled, newCapacity))
+        newCapacity <<= 1;
+      if (newCapacity >= capacity) return false;
+      elems.resize(capacity, newCapacity, occupied);
+      occupied = trealloc<uint64_t>(occupied, occWords(newCapacity));
+      capacity = newCapacity;
+      policy.rebuild(occupied, capacity);
+      resetShrinkCheck();
+      return true;
+    }
+    void autoShrink() {
+      // If the upper half is still in use, don't look again until the
+      // element count has halved once more.
+      if (!trim(2 * filled)) nextShrinkCheck = filled / 2;
     }
+    void resetShrinkCheck() {
+      nextShrinkCheck =
+        shrinkDenominator == 0 ? 0 : capacity / shrinkDenominator;
+    }
+    using Elems = typename Storage::template Impl<T, Alloc>;
     size_t filled;
     size_t capacity;
-    T* elems;
-    bool* allocated;
-    std::minstd_rand r;
+    Elems elems;
+    uint64_t* occupied;
+    ZK_NOUNIQADDR Policy policy;
+    size_t shrinkDenominator;
+    size_t nextShrinkCheck;
   };
 }
-#endif
\ No newline at end of file
+#endif
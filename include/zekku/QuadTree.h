@@ -10,11 +10,16 @@
 #include <functional>
 #include <iostream>
 #include <limits>
+#include <queue>
 #include <type_traits>
+#include <utility>
+#include <vector>
 #include <glm/glm.hpp>
 #include "zekku/base.h"
 #include "zekku/Pool.h"
+#include "zekku/bitwise.h"
 #include "zekku/geometry.h"
+#include "zekku/simd.h"
 #include "zekku/timath.h"
 
 namespace zekku {
@@ -22,7 +27,7 @@ namespace zekku {
   struct DefaultGetXY {
     static_assert(std::numeric_limits<F>::is_specialized,
       "Your F is not a number, dum dum!");
-    glm::tvec2<F> operator()(T t) const { return {t.x, t.y}; }
+    glm::tvec2<F> operator()(const T& t) const { return {t.x, t.y}; }
   };
   template<typename F = float>
   struct QueryAll {
@@ -47,7 +52,40 @@ namespace zekku {
       return (std::hash<I>(h.nodeid) << 16) ^ std::hash<I>(h.index);
     }
   };
+  // One element found by a batch of queries: handle is in the shape at
+  // index query of the batch.
+  template<typename H>
+  struct BasicQueryHit {
+    size_t query;
+    H handle;
+  };
+  // What QuadTree::queryBatch finds
+  template<typename I = uint16_t>
+  using QueryHit = BasicQueryHit<Handle<I>>;
+  // What a query callback can tell the traversal to do next.
+  enum class Traversal { CONTINUE, STOP };
+  // Calls a query callback, treating one that returns nothing as if it
+  // had returned CONTINUE.
+  template<typename C, typename E>
+  auto callVisitor(C& callback, E& elem) -> typename std::enable_if<
+      std::is_void<decltype(callback(elem))>::value, Traversal>::type {
+    callback(elem);
+    return Traversal::CONTINUE;
+  }
+  template<typename C, typename E>
+  auto callVisitor(C& callback, E& elem) -> typename std::enable_if<
+      !std::is_void<decltype(callback(elem))>::value, Traversal>::type {
+    return callback(elem);
+  }
+  // Default callback for elements moved by QuadTree::remove.
+  template<typename I = uint16_t>
+  struct IgnoreMoves {
+    void operator()(
+      const Handle<I>& /*from*/, const Handle<I>& /*to*/) const {}
+  };
   constexpr size_t QUADTREE_NODE_COUNT = 32;
+  // Most times a tree's box doubles in size to take in one element
+  constexpr size_t QUADTREE_MAX_GROWTH = 32;
   template<
     typename T,
     typename I = uint16_t,
@@ -63,6 +101,7 @@ namespace zekku {
       "Don't use a signed int for sizes, dum dum!");
     static_assert(std::numeric_limits<F>::is_specialized,
       "Your F is not a number, dum dum!");
+    using HandleType = Handle<I>;
     template<typename... Args>
     QuadTree(const AABB<F>& box, Args&&... args) :
         root((I) nodes.allocate()), box(box), gxy(args...) {}
@@ -79,39 +118,259 @@ namespace zekku {
       gxy = other.gxy;
       return *this;
     }
-    Handle<I> insert(const T& t) {
+    // Inserting may split a full leaf, which moves the elements in it:
+    // onMove(from, to) is called after each one moves.
+    // An element outside the box makes the tree grow (see growToFit).
+    template<typename M = IgnoreMoves<I>>
+    Handle<I> insert(const T& t, M onMove = M()) {
       T t2 = t;
-      return insert(std::move(t2));
+      return insert(std::move(t2), onMove);
     }
-    Handle<I> insert(T&& t) {
+    template<typename M = IgnoreMoves<I>>
+    Handle<I> insert(T&& t, M onMove = M()) {
       glm::tvec2<F> p = gxy(t);
-      if (!box.contains(p)) {
-        std::cerr << "(" << p[0] << ", " << p[1] << ") is out of range!\n";
-        std::cerr << "Box is centred at (" << box.c[0] << ", " << box.c[1] << ") ";
-        std::cerr << "with w = " << box.s[0] << " and h = " << box.s[1] << "\n";
-        exit(-1);
-      }
-      Handle<I> h = insert(std::move(t), p, root, box);
+      grow(p, onMove);
+      Handle<I> h = insert(std::move(t), p, root, box, onMove);
       assert(nodes.getCapacity() <= std::numeric_limits<I>::max());
       return h;
     }
+    // Replaces the contents of the tree with the elements in [begin, end),
+    // which must be random access iterators.
+    // The elements are put in Morton order one quadrant digit at a time
+    // (a stable radix sort that stops as soon as a run fits in a leaf),
+    // and the tree is laid out top down as it goes, so each element is
+    // copied only once, straight into its leaf. The tree has the same
+    // shape (and the same order of elements in each leaf) as inserting
+    // the elements one by one would give, except around clumps of
+    // identical points, which end up in one overflow chain.
+    // The box is grown first if some of the elements are outside it.
+    template<typename It>
+    void build(It begin, It end) {
+      size_t count = (size_t) (end - begin);
+      BuildState st;
+      for (size_t k = 0; k < 2; ++k) {
+        st.order[k].resize(count);
+        st.positions[k].resize(count);
+        st.classes[k].resize(count);
+      }
+      bool exact;
+      for (size_t i = 0; i < count; ++i) {
+        glm::tvec2<F> p = gxy(begin[i]);
+        box = fittedBox(box, p, exact);
+        st.order[0][i] = i;
+        st.positions[0][i] = p;
+      }
+      size_t counts[4] = {0, 0, 0, 0};
+      for (size_t i = 0; i < count; ++i) {
+        size_t c = box.getClass(st.positions[0][i]);
+        st.classes[0][i] = (uint8_t) c;
+        ++counts[c];
+      }
+      nodes = Pool<Node, FreeList>();
+      root = createNode();
+      build(root, box, 0, begin, st, 0, 0, count, counts);
+      assert(nodes.getCapacity() <= std::numeric_limits<I>::max());
+    }
+    // Removes the element at h, touching only the leaf it is in (and the
+    // end of its overflow chain, if any). A stem whose children are all
+    // leaves holding at most nc / 2 elements between them is merged back
+    // into a leaf, up the tree as far as possible.
+    // Other elements may move as a result: onMove(from, to) is called
+    // after each one moves. Handles of elements that aren't reported
+    // stay valid.
+    template<typename M = IgnoreMoves<I>>
+    void remove(const Handle<I>& h, M onMove = M()) {
+      std::vector<I>& path = scratchPath;
+      path.clear();
+      I prev = locate(h, path);
+      if (nodes.get(h.nodeid).nodeCount == LINK) {
+        fillLinkHole(h, path, onMove);
+      } else {
+        takeFromLeaf(h.nodeid, h.index, onMove);
+        unlinkIfEmpty(h.nodeid, prev);
+      }
+      mergeUp(path, onMove);
+    }
+    // Replaces the element at h with t, which may be somewhere else.
+    // If t stays in the same leaf, it is replaced in place and h stays
+    // valid; otherwise this is a remove followed by an insert (with
+    // onMove called as for remove). Returns the new handle of t.
+    template<typename M = IgnoreMoves<I>>
+    Handle<I> update(const Handle<I>& h, const T& t, M onMove = M()) {
+      glm::tvec2<F> p = gxy(t);
+      if (!box.contains(p)) {
+        remove(h, onMove);
+        return insert(t, onMove);
+      }
+      glm::tvec2<F> p0 = posOf(nodes.get(h.nodeid), h.index);
+      if (sameWayDown(h, p0, p)) {
+        Node& n = nodes.get(h.nodeid);
+        n.hash ^= hashOf(p0) ^ hashOf(p);
+        place(n, h.index, T(t), p);
+        return h;
+      }
+      remove(h, onMove);
+      return insert(t, onMove);
+    }
+    // Leaves keep their own copy of each element's position, so don't
+    // move an element through deref or querym: use update instead.
+    // GetXY is only called on elements coming into the tree (by insert,
+    // update and build); everything else uses the copy.
     const T& deref(const Handle<I>& h) const {
       return nodes.get(h.nodeid).nodes[h.index];
     }
     T& deref(const Handle<I>& h) {
       return nodes.get(h.nodeid).nodes[h.index];
     }
+    // Where the element at h is, without touching the element
+    glm::tvec2<F> positionOf(const Handle<I>& h) const {
+      return posOf(nodes.get(h.nodeid), h.index);
+    }
+    // All of the query methods share one traversal, which keeps its own
+    // stack instead of recursing. The callback may return
+    // Traversal::STOP to end the query early (or nothing to go on);
+    // callback forms return false if they were stopped.
+    // The const queries only read the tree, so any number of threads can
+    // run them at once as long as nothing is modifying it (see
+    // zekku/parallel.h).
     template<typename Q = AABB<T>>
     void query(const Q& shape, std::vector<Handle<I>>& out) const {
-      query(shape, out, root, box);
+      auto visit = [&out](I node, I i) {
+        out.push_back({node, i});
+        return Traversal::CONTINUE;
+      };
+      traverse(shape, visit);
     }
     template<typename Q = AABB<T>, typename C>
-    void query(const Q& shape, C callback) const {
-      query(shape, callback, root, box);
+    bool query(const Q& shape, C callback) const {
+      auto visit = [this, &callback](I node, I i) {
+        return callVisitor(callback, nodes.get(node).nodes[i]);
+      };
+      return traverse(shape, visit);
     }
     template<typename Q = AABB<T>, typename C>
-    void querym(const Q& shape, C callback) {
-      querym(shape, callback, root, box);
+    bool querym(const Q& shape, C callback) {
+      auto visit = [this, &callback](I node, I i) {
+        return callVisitor(callback, nodes.get(node).nodes[i]);
+      };
+      return traverse(shape, visit);
+    }
+    // Finds any one element in shape, stopping as soon as it does.
+    // Returns false if there is none.
+    template<typename Q = AABB<T>>
+    bool queryFirst(const Q& shape, Handle<I>& out) const {
+      auto visit = [&out](I node, I i) {
+        out = {node, i};
+        return Traversal::STOP;
+      };
+      return !traverse(shape, visit);
+    }
+    // Runs every query in shapes in one pass down the tree, appending a
+    // QueryHit to out for each element found. Each node is visited once
+    // for the whole batch, with the shapes that reach it; these are kept
+    // in Morton order of their centres (see centreOf), so shapes tested
+    // one after another are near each other. Hits come out grouped by
+    // leaf, not by query.
+    // This pays off when many shapes share nodes; a shape that is alone
+    // in a subtree carries on as an ordinary query.
+    template<typename Q>
+    void queryBatch(
+        const std::vector<Q>& shapes, std::vector<QueryHit<I>>& out) const {
+      // Morton key in the top half, index in the bottom half
+      std::vector<uint64_t> keyed;
+      keyed.reserve(shapes.size());
+      for (size_t i = 0; i < shapes.size(); ++i) {
+        if (!shapes[i].intersects(box)) continue;
+        uint64_t k = mortonKey(box, centreOf(shapes[i]), BATCH_KEY_LEVELS);
+        keyed.push_back((k << 32) | i);
+      }
+      std::sort(keyed.begin(), keyed.end());
+      // Copied in order, so that they are read front to back
+      std::vector<Q> sorted;
+      std::vector<uint32_t> ids;
+      sorted.reserve(keyed.size());
+      ids.reserve(keyed.size());
+      for (uint64_t k : keyed) {
+        ids.push_back((uint32_t) k);
+        sorted.push_back(shapes[(uint32_t) k]);
+      }
+      // The shapes reaching each node on the stack are a range of this
+      // (as indices into sorted). A child's range is appended after its
+      // parent's, and is dropped once its subtree is done.
+      std::vector<uint32_t> active(keyed.size());
+      for (size_t j = 0; j < keyed.size(); ++j) active[j] = (uint32_t) j;
+      std::vector<BatchEntry> stack;
+      stack.push_back({root, box, 0, active.size()});
+      while (!stack.empty()) {
+        BatchEntry e = stack.back();
+        stack.pop_back();
+        active.resize(e.hi);
+        if (e.hi - e.lo == 1) {
+          // Nothing left to share, so this one can go on by itself
+          uint32_t q = active[e.lo];
+          size_t query = ids[q];
+          auto emit = [&out, query](I node, I i) {
+            out.push_back({query, {node, i}});
+            return Traversal::CONTINUE;
+          };
+          traverse(sorted[q], e.node, e.box, emit);
+          continue;
+        }
+        I cur = e.node;
+        const Node* n = &nodes.get(cur);
+        while (n->nodeCount == LINK) {
+          batchLeaf(sorted, ids, active, e, cur, *n, nc, out);
+          cur = n->children[0];
+          n = &nodes.get(cur);
+        }
+        if (n->nodeCount != NOWHERE) {
+          batchLeaf(sorted, ids, active, e, cur, *n, n->nodeCount, out);
+          continue;
+        }
+        // Children go on in reverse, so that NW comes off first and its
+        // range is the last one in active
+        glm::tvec2<F> h = e.box.s * oneHalf<F>;
+        for (size_t c = 4; c > 0; --c) {
+          AABB<F> sub = {{
+            ((c - 1) & 1) != 0 ? e.box.c.x + h.x : e.box.c.x - h.x,
+            ((c - 1) & 2) != 0 ? e.box.c.y + h.y : e.box.c.y - h.y,
+          }, h};
+          // Written without branching on intersects, which is hard to
+          // predict
+          size_t lo = active.size(), hi = lo;
+          active.resize(lo + (e.hi - e.lo));
+          for (size_t j = e.lo; j < e.hi; ++j) {
+            uint32_t q = active[j];
+            active[hi] = q;
+            hi += sorted[q].intersects(sub);
+          }
+          active.resize(hi);
+          if (hi > lo) stack.push_back({n->children[c - 1], sub, lo, hi});
+        }
+      }
+    }
+    // Appends the handles of the (up to) k elements nearest to p to out,
+    // nearest first. Nodes are visited in order of their distance from p,
+    // and the search stops once the next one is further away than the
+    // k-th nearest element found so far.
+    void knn(glm::tvec2<F> p, size_t k, std::vector<Handle<I>>& out) const {
+      knn(p, k, nullptr, out);
+    }
+    // Same, but only considers elements within radius of p.
+    void knn(
+        glm::tvec2<F> p, size_t k, F radius,
+        std::vector<Handle<I>>& out) const {
+      Distance maxD2 = longMultiply(radius, radius);
+      knn(p, k, &maxD2, out);
+    }
+    // Finds the element nearest to p within radius of it.
+    // Returns false if there is none.
+    bool nearest(glm::tvec2<F> p, F radius, Handle<I>& out) const {
+      std::vector<Handle<I>> found;
+      knn(p, 1, radius, found);
+      if (found.empty()) return false;
+      out = found[0];
+      return true;
     }
     template<typename C>
     QuadTree map(const C& f) const {
@@ -124,7 +383,7 @@ namespace zekku {
     template<typename C>
     QuadTree mapm(const C& f) {
       QuadTree q(box, gxy);
-      query(QueryAll<F>(), [&q, f](T&& t) {
+      querym(QueryAll<F>(), [&q, f](T& t) {
         q.insert(f(std::move(t)));
       });
       return q;
@@ -140,23 +399,72 @@ namespace zekku {
     template<typename C, typename P>
     QuadTree mapmIf(const C& f, const P& b) {
       QuadTree q(box, gxy);
-      query(QueryAll<F>(), [&q, f, b](T&& t) {
+      querym(QueryAll<F>(), [&q, f, b](T& t) {
         if (b(t)) q.insert(f(std::move(t)));
       });
       return q;
     }
+    // Bytes held by the node pool, not counting its bookkeeping
+    size_t memoryUsage() const {
+      return nodes.getCapacity() * sizeof(Node);
+    }
+    const AABB<F>& getBox() const { return box; }
+    // Grows the box until it contains p, doubling it at most
+    // QUADTREE_MAX_GROWTH times. Each doubling puts a new root above the
+    // old one, with the old box as one of its quadrants, so nothing is
+    // moved. (This needs the old box to come out exactly as a quadrant of
+    // the new one. If rounding gets in the way, the tree is rebuilt in the
+    // new box instead, and every element is reported to onMove.)
+    template<typename M = IgnoreMoves<I>>
+    void growToFit(glm::tvec2<F> p, M onMove = M()) {
+      grow(p, onMove);
+    }
+    // Shrinks the box back down while all of the elements are in one
+    // quadrant of the root, making that quadrant the root. Nothing is
+    // moved, and handles stay valid. Returns true if the box changed.
+    bool shrinkToFit() {
+      bool shrunk = false;
+      while (true) {
+        const Node& r = nodes.get(root);
+        if (r.nodeCount != NOWHERE) return shrunk;
+        I children[4];
+        std::copy(r.children, r.children + 4, children);
+        int only = -1;
+        for (int c = 0; c < 4; ++c) {
+          if (nodes.get(children[c]).nodeCount == 0) continue;
+          if (only != -1) return shrunk;
+          only = c;
+        }
+        if (only == -1) return shrunk;
+        for (int c = 0; c < 4; ++c) {
+          if (c != only) nodes.deallocate(children[c]);
+        }
+        nodes.deallocate(root);
+        root = children[only];
+        box = box.getSubboxByClass((uint32_t) only);
+        shrunk = true;
+      }
+    }
     void dump() const {
       dump(root, box);
     }
   private:
     static constexpr I NOWHERE = -1;
     static constexpr I LINK = -2;
+    // Deeper than this, build gives up on splitting boxes
+    static constexpr size_t MAX_BUILD_DEPTH = 64;
+    // Digits of Morton key that queryBatch sorts shapes by
+    static constexpr size_t BATCH_KEY_LEVELS = 8;
     class Node {
     public:
       Node() :
+        xs{}, ys{},
         children{NOWHERE, NOWHERE, NOWHERE, NOWHERE},
         nodeCount(0), hash(0) {}
       T nodes[nc];
+      // Where each element in nodes is, for LeafKernel to test in bulk.
+      // Lanes from nodeCount on are loaded but ignored.
+      F xs[padToLanes(nc)], ys[padToLanes(nc)];
       // The following fields are unspecified if nodeCount < nc.
       // If nodeCount == LINK, then nw contains the node with additional
       // nodes and the rest of the fields are unspecified.
@@ -166,30 +474,515 @@ namespace zekku {
       I nodeCount; // Set to NOWHERE if not a leaf.
       size_t hash;
     };
-    Pool<Node> nodes;
+    // Nodes come from a free list, so they are handed out in order:
+    // a tree made by build is laid out depth first.
+    Pool<Node, FreeList> nodes;
     I root;
     AABB<F> box;
     ZK_NOUNIQADDR GetXY gxy;
+    std::vector<I> scratchPath; // Stems passed by remove
     I createNode() {
       size_t i = nodes.allocate();
       nodes.get(i).nodeCount = 0;
       return (I) i;
     }
-    Handle<I> insertStem(T&& t, glm::tvec2<F>& p, Node& n, AABB<F> box) {
+    static glm::tvec2<F> posOf(const Node& n, size_t i) {
+      return {n.xs[i], n.ys[i]};
+    }
+    // Puts t, which is at p, at index i of n
+    static void place(Node& n, size_t i, T&& t, glm::tvec2<F> p) {
+      n.nodes[i] = std::move(t);
+      n.xs[i] = p.x;
+      n.ys[i] = p.y;
+    }
+    static void moveElem(Node& from, size_t j, Node& to, size_t i) {
+      place(to, i, std::move(from.nodes[j]), posOf(from, j));
+    }
+    // order[k][i] is the index of the i-th element in Morton order so far,
+    // positions[k][i] is where it is, and classes[k][i] is its quadrant
+    // in the box of the node it is about to go into. Each level of the
+    // sort moves the elements from one k to the other.
+    struct BuildState {
+      std::vector<size_t> order[2];
+      std::vector<glm::tvec2<F>> positions[2];
+      std::vector<uint8_t> classes[2];
+    };
+    // Builds the subtree at node for the elements in [lo, hi) of st,
+    // which are in order of their original index. counts[c] is the number
+    // of them in quadrant c.
+    template<typename It>
+    void build(
+        I node, AABB<F> b, size_t depth, It begin, BuildState& st,
+        size_t k, size_t lo, size_t hi, const size_t* counts) {
+      const std::vector<size_t>& order = st.order[k];
+      const std::vector<glm::tvec2<F>>& positions = st.positions[k];
+      if (hi - lo <= nc) {
+        fillLeaf(nodes.get(node), begin, st, k, lo, hi);
+        return;
+      }
+      if (std::max({counts[0], counts[1], counts[2], counts[3]}) ==
+          hi - lo && allSame(positions, lo, hi)) {
+        // Can't be split, so chain full nodes together
+        while (hi - lo > nc) {
+          fillLeaf(nodes.get(node), begin, st, k, lo, lo + nc);
+          lo += nc;
+          I next = createNode();
+          nodes.get(node).nodeCount = LINK;
+          nodes.get(node).children[0] = next;
+          node = next;
+        }
+        fillLeaf(nodes.get(node), begin, st, k, lo, hi);
+        return;
+      }
+      if (depth == MAX_BUILD_DEPTH) {
+        // The box can't be split any more, so insert the rest the slow way
+        IgnoreMoves<I> ignore;
+        for (size_t i = lo; i < hi; ++i) {
+          glm::tvec2<F> p = positions[i];
+          insert(T(begin[order[i]]), p, node, b, ignore);
+        }
+        return;
+      }
+      // Split the run by quadrant, keeping each part in order, and find
+      // out where each element goes within its quadrant on the way
+      AABB<F> subs[4];
+      size_t at[4];
+      size_t starts[5];
+      size_t subcounts[4][4] = {};
+      starts[0] = lo;
+      for (uint32_t c = 0; c < 4; ++c) {
+        subs[c] = b.getSubboxByClass(c);
+        at[c] = starts[c];
+        starts[c + 1] = starts[c] + counts[c];
+      }
+      const std::vector<uint8_t>& classes = st.classes[k];
+      std::vector<size_t>& newOrder = st.order[1 - k];
+      std::vector<glm::tvec2<F>>& newPositions = st.positions[1 - k];
+      std::vector<uint8_t>& newClasses = st.classes[1 - k];
+      for (size_t i = lo; i < hi; ++i) {
+        size_t c = classes[i];
+        size_t j = at[c]++;
+        size_t cc = subs[c].getClass(positions[i]);
+        newOrder[j] = order[i];
+        newPositions[j] = positions[i];
+        newClasses[j] = (uint8_t) cc;
+        ++subcounts[c][cc];
+      }
+      I children[4];
+      for (size_t c = 0; c < 4; ++c) children[c] = createNode();
+      Node& n = nodes.get(node);
+      for (size_t c = 0; c < 4; ++c) n.children[c] = children[c];
+      n.nodeCount = NOWHERE;
+      for (size_t c = 0; c < 4; ++c) {
+        build(children[c], subs[c], depth + 1, begin, st,
+          1 - k, starts[c], starts[c + 1], subcounts[c]);
+      }
+    }
+    template<typename It>
+    void fillLeaf(
+        Node& n, It begin, const BuildState& st,
+        size_t k, size_t lo, size_t hi) {
+      for (size_t i = lo; i < hi; ++i)
+        place(n, i - lo, T(begin[st.order[k][i]]), st.positions[k][i]);
+      n.nodeCount = (I) (hi - lo);
+      n.hash = hashLeaf(n);
+    }
+    static bool allSame(
+        const std::vector<glm::tvec2<F>>& positions, size_t lo, size_t hi) {
+      glm::tvec2<F> p = positions[lo];
+      for (size_t i = lo + 1; i < hi; ++i) {
+        if (positions[i].x != p.x || positions[i].y != p.y) return false;
+      }
+      return true;
+    }
+    // Squared distances are kept in DoubleType<F> so that they are
+    // exact for fixed-point F.
+    using Distance = DoubleType<F>;
+    static Distance distance2(glm::tvec2<F> a, glm::tvec2<F> b) {
+      F dx = a.x - b.x;
+      F dy = a.y - b.y;
+      return longMultiply(dx, dx) + longMultiply(dy, dy);
+    }
+    // Squared distance from p to the nearest point in b
+    static Distance distance2(glm::tvec2<F> p, const AABB<F>& b) {
+      F dx = std::max(zekku::abs(p.x - b.c.x) - b.s.x, F{0});
+      F dy = std::max(zekku::abs(p.y - b.c.y) - b.s.y, F{0});
+      return longMultiply(dx, dx) + longMultiply(dy, dy);
+    }
+    struct NodeDistance {
+      Distance d2;
+      I node;
+      AABB<F> box;
+      // Reversed, so that a priority queue pops the nearest node first
+      bool operator<(const NodeDistance& other) const {
+        return other.d2 < d2;
+      }
+    };
+    struct ElemDistance {
+      Distance d2;
+      Handle<I> h;
+      bool operator<(const ElemDistance& other) const {
+        return d2 < other.d2;
+      }
+    };
+    void knn(
+        glm::tvec2<F> p, size_t k, const Distance* maxD2,
+        std::vector<Handle<I>>& out) const {
+      if (k == 0) return;
+      std::priority_queue<NodeDistance> frontier;
+      // The k nearest so far, with the furthest of them on top
+      std::priority_queue<ElemDistance> best;
+      // Could something at this distance still make it into best?
+      auto worthIt = [&](const Distance& d2) {
+        if (maxD2 != nullptr && *maxD2 < d2) return false;
+        return best.size() < k || d2 < best.top().d2;
+      };
+      auto consider = [&](const Node& n, I node, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+          Distance d2 = distance2(p, posOf(n, i));
+          if (!worthIt(d2)) continue;
+          if (best.size() == k) best.pop();
+          best.push({d2, {node, (I) i}});
+        }
+      };
+      frontier.push({distance2(p, box), root, box});
+      while (!frontier.empty()) {
+        NodeDistance nd = frontier.top();
+        frontier.pop();
+        // Everything left is at least this far away
+        if (!worthIt(nd.d2)) break;
+        I cur = nd.node;
+        // Overflow chains all share the same box
+        while (nodes.get(cur).nodeCount == LINK) {
+          consider(nodes.get(cur), cur, nc);
+          cur = nodes.get(cur).children[0];
+        }
+        const Node& n = nodes.get(cur);
+        if (n.nodeCount == NOWHERE) {
+          for (uint32_t c = 0; c < 4; ++c) {
+            AABB<F> sub = nd.box.getSubboxByClass(c);
+            Distance d2 = distance2(p, sub);
+            if (worthIt(d2)) frontier.push({d2, n.children[c], sub});
+          }
+        } else {
+          consider(n, cur, n.nodeCount);
+        }
+      }
+      size_t start = out.size();
+      out.resize(start + best.size());
+      for (size_t i = out.size(); i > start; --i) {
+        out[i - 1] = best.top().h;
+        best.pop();
+      }
+    }
+    template<typename M>
+    void grow(glm::tvec2<F> p, M& onMove) {
+      if (box.contains(p)) return;
+      bool exact;
+      AABB<F> target = fittedBox(box, p, exact);
+      const Node& r = nodes.get(root);
+      // A lone leaf doesn't care what its box is
+      if (r.nodeCount != NOWHERE && r.nodeCount != LINK) {
+        box = target;
+        return;
+      }
+      if (!exact) {
+        rebuildIn(target, onMove);
+        return;
+      }
+      while (!(box == target)) {
+        uint32_t q;
+        AABB<F> grown = growToward(box, p, q);
+        I children[4];
+        for (uint32_t c = 0; c < 4; ++c)
+          children[c] = c == q ? root : createNode();
+        I stem = createNode();
+        Node& s = nodes.get(stem);
+        std::copy(children, children + 4, s.children);
+        s.nodeCount = NOWHERE;
+        root = stem;
+        box = grown;
+      }
+    }
+    // The box that growToFit(p) would grow b into. exact is set to
+    // false if some doubling of it doesn't have the box before it as an
+    // exact quadrant.
+    AABB<F> fittedBox(
+        AABB<F> b, glm::tvec2<F> p, bool& exact) const {
+      exact = true;
+      for (size_t i = 0; !b.contains(p); ++i) {
+        if (i == QUADTREE_MAX_GROWTH) {
+          std::cerr << "(" << p[0] << ", " << p[1] << ") is out of range!\n";
+          std::cerr << "Box is centred at (" << box.c[0] << ", " << box.c[1] << ") ";
+          std::cerr << "with w = " << box.s[0] << " and h = " << box.s[1] << "\n";
+          exit(-1);
+        }
+        uint32_t q;
+        AABB<F> grown = growToward(b, p, q);
+        if (!(grown.getSubboxByClass(q) == b)) exact = false;
+        b = grown;
+      }
+      return b;
+    }
+    // Inserts every element again in a new box. Each element is reported
+    // to onMove once, from its old handle to its new one, after they have
+    // all been moved.
+    template<typename M>
+    void rebuildIn(const AABB<F>& newBox, M& onMove) {
+      std::vector<Handle<I>> from;
+      query(QueryAll<F>(), from);
+      std::vector<T> elems;
+      std::vector<glm::tvec2<F>> positions;
+      elems.reserve(from.size());
+      positions.reserve(from.size());
+      for (const Handle<I>& h : from) {
+        Node& n = nodes.get(h.nodeid);
+        elems.push_back(std::move(n.nodes[h.index]));
+        positions.push_back(posOf(n, h.index));
+      }
+      nodes = Pool<Node, FreeList>();
+      root = createNode();
+      box = newBox;
+      // to[i] is where element i is now, and owner[nodeid * nc + index]
+      // is the element at a handle
+      std::vector<Handle<I>> to(from.size());
+      std::vector<size_t> owner;
+      auto own = [&owner](const Handle<I>& h) -> size_t& {
+        size_t k = (size_t) h.nodeid * nc + h.index;
+        if (k >= owner.size()) owner.resize(2 * k + nc);
+        return owner[k];
+      };
+      auto track = [&to, &own](const Handle<I>& a, const Handle<I>& b) {
+        size_t i = own(a);
+        to[i] = b;
+        own(b) = i;
+      };
+      for (size_t i = 0; i < elems.size(); ++i) {
+        to[i] = insert(std::move(elems[i]), positions[i], root, box, track);
+        own(to[i]) = i;
+      }
+      for (size_t i = 0; i < from.size(); ++i) onMove(from[i], to[i]);
+    }
+    static size_t hashOf(glm::tvec2<F> p) {
+      return (std::hash<F>{}(p.x) << 1) ^ std::hash<F>{}(p.y);
+    }
+    static size_t hashLeaf(const Node& n) {
+      size_t hash = 0;
+      for (size_t i = 0; i < n.nodeCount; ++i)
+        hash ^= hashOf(posOf(n, i));
+      return hash;
+    }
+    // Does p take the same way down to h's node as p0, h's position?
+    bool sameWayDown(
+        const Handle<I>& h, glm::tvec2<F> p0, glm::tvec2<F> p) const {
+      I cur = root;
+      AABB<F> b = box;
+      while (cur != h.nodeid) {
+        const Node& n = nodes.get(cur);
+        if (n.nodeCount == LINK) {
+          cur = n.children[0];
+        } else if (n.nodeCount == NOWHERE) {
+          size_t c = b.getClass(p0);
+          if (b.getClass(p) != c) return false;
+          cur = n.children[c];
+          b = b.getSubboxByClass(c);
+        } else {
+          return false; // (see locate)
+        }
+      }
+      return true;
+    }
+    static void notInTree(const Handle<I>& h) {
+      std::cerr << "Handle (" << h.nodeid << ", " << h.index;
+      std::cerr << ") is not in the tree!\n";
+      exit(-1);
+    }
+    // Finds the node holding h by following its element down from the
+    // root. Appends the stems passed on the way to path, and returns the
+    // overflow node linking to h's node (or NOWHERE).
+    I locate(const Handle<I>& h, std::vector<I>& path) const {
+      glm::tvec2<F> p = posOf(nodes.get(h.nodeid), h.index);
+      size_t start = path.size();
+      I cur = root, prev = NOWHERE;
+      AABB<F> b = box;
+      while (cur != h.nodeid) {
+        const Node& n = nodes.get(cur);
+        if (n.nodeCount == LINK) {
+          prev = cur;
+          cur = n.children[0];
+        } else if (n.nodeCount == NOWHERE) {
+          path.push_back(cur);
+          prev = NOWHERE;
+          size_t c = b.getClass(p);
+          cur = n.children[c];
+          b = b.getSubboxByClass(c);
+        } else {
+          // When the box grows west or north, elements on the old box's
+          // west or north edge stay in the old box, though getClass sends
+          // them the other way. Look in every quadrant with p in it.
+          path.resize(start);
+          if (!findNode(root, box, p, h.nodeid, path, prev)) notInTree(h);
+          return prev;
+        }
+      }
+      return prev;
+    }
+    // Searches the subtree at cur (with box b) for target, in every
+    // quadrant that contains p, as locate does.
+    bool findNode(
+        I cur, const AABB<F>& b, glm::tvec2<F> p, I target,
+        std::vector<I>& path, I& prev) const {
+      I before = NOWHERE;
+      while (cur != target) {
+        const Node& n = nodes.get(cur);
+        if (n.nodeCount == LINK) {
+          before = cur;
+          cur = n.children[0];
+          continue;
+        }
+        if (n.nodeCount != NOWHERE) return false;
+        path.push_back(cur);
+        for (uint32_t c = 0; c < 4; ++c) {
+          AABB<F> sub = b.getSubboxByClass(c);
+          if (sub.contains(p) &&
+              findNode(n.children[c], sub, p, target, path, prev))
+            return true;
+        }
+        path.pop_back();
+        return false;
+      }
+      prev = before;
+      return true;
+    }
+    // Removes the element at index i of a leaf, moving the leaf's last
+    // element into the gap.
+    template<typename M>
+    T takeFromLeaf(I leaf, I i, M& onMove) {
+      Node& n = nodes.get(leaf);
+      T t = std::move(n.nodes[i]);
+      n.hash ^= hashOf(posOf(n, i));
+      I last = (I) (n.nodeCount - 1);
+      if (i != last) {
+        moveElem(n, last, n, i);
+        onMove(Handle<I>{leaf, last}, Handle<I>{leaf, i});
+      }
+      --n.nodeCount;
+      return t;
+    }
+    // An empty leaf at the end of an overflow chain is dropped,
+    // and the node before it becomes a full leaf again.
+    void unlinkIfEmpty(I leaf, I prev) {
+      if (prev == NOWHERE || nodes.get(leaf).nodeCount != 0) return;
+      nodes.deallocate(leaf);
+      Node& pn = nodes.get(prev);
+      pn.nodeCount = (I) nc;
+      pn.hash = hashLeaf(pn);
+    }
+    // Overflow nodes must stay full, so a hole in one is filled with an
+    // element from the end of its chain. If the chain ends in a stem,
+    // any element under that stem will do, since they are all in the
+    // same box.
+    template<typename M>
+    void fillLinkHole(
+        const Handle<I>& h, std::vector<I>& path, M& onMove) {
+      I prev = h.nodeid;
+      I tail = nodes.get(prev).children[0];
+      while (nodes.get(tail).nodeCount == LINK) {
+        prev = tail;
+        tail = nodes.get(tail).children[0];
+      }
+      if (nodes.get(tail).nodeCount == NOWHERE) {
+        bool found = findLeaf(tail, NOWHERE, path, tail, prev);
+        assert(found);
+        (void) found;
+      }
+      I last = (I) (nodes.get(tail).nodeCount - 1);
+      glm::tvec2<F> p = posOf(nodes.get(tail), last);
+      T t = takeFromLeaf(tail, last, onMove);
+      place(nodes.get(h.nodeid), h.index, std::move(t), p);
+      onMove(Handle<I>{tail, last}, h);
+      unlinkIfEmpty(tail, prev);
+    }
+    // Finds a non-empty leaf under root, appending the stems on the way
+    // to path.
+    bool findLeaf(
+        I root, I prev, std::vector<I>& path,
+        I& leaf, I& leafPrev) const {
+      const Node& n = nodes.get(root);
+      if (n.nodeCount == LINK)
+        return findLeaf(n.children[0], root, path, leaf, leafPrev);
+      if (n.nodeCount == NOWHERE) {
+        path.push_back(root);
+        for (size_t i = 0; i < 4; ++i) {
+          if (findLeaf(n.children[i], NOWHERE, path, leaf, leafPrev))
+            return true;
+        }
+        path.pop_back();
+        return false;
+      }
+      if (n.nodeCount == 0) return false;
+      leaf = root;
+      leafPrev = prev;
+      return true;
+    }
+    // Merges stems on the path back into leaves, from the bottom up,
+    // until one can't be merged.
+    template<typename M>
+    void mergeUp(const std::vector<I>& path, M& onMove) {
+      for (size_t k = path.size(); k > 0; --k) {
+        I stem = path[k - 1];
+        const Node& s = nodes.get(stem);
+        if (s.nodeCount != NOWHERE) continue; // Already merged
+        size_t total = 0;
+        for (size_t i = 0; i < 4; ++i) {
+          const Node& child = nodes.get(s.children[i]);
+          if (child.nodeCount == NOWHERE || child.nodeCount == LINK) return;
+          total += child.nodeCount;
+        }
+        if (total > nc / 2) return;
+        merge(stem, onMove);
+      }
+    }
+    template<typename M>
+    void merge(I stem, M& onMove) {
+      Node& s = nodes.get(stem);
+      I children[4] = {
+        s.children[0], s.children[1], s.children[2], s.children[3]
+      };
+      I count = 0;
+      size_t hash = 0;
+      for (size_t i = 0; i < 4; ++i) {
+        Node& child = nodes.get(children[i]);
+        for (I j = 0; j < child.nodeCount; ++j) {
+          moveElem(child, j, s, count);
+          hash ^= hashOf(posOf(s, count));
+          onMove(Handle<I>{children[i], j}, Handle<I>{stem, count});
+          ++count;
+        }
+        nodes.deallocate(children[i]);
+      }
+      s.nodeCount = count;
+      s.hash = hash;
+    }
+    template<typename M>
+    Handle<I> insertStem(
+        T&& t, glm::tvec2<F>& p, Node& n, AABB<F> box, M& onMove) {
       size_t c = box.getClass(p);
-      return insert(std::move(t), p, n.children[c], box.getSubboxByClass(c));
+      return insert(
+        std::move(t), p, n.children[c], box.getSubboxByClass(c), onMove);
     }
 #define n (nodes.get(root))
     // Insert an element in the qtree
-    Handle<I> insert(T&& t, glm::tvec2<F>& p, I root, AABB<F> box) {
+    template<typename M>
+    Handle<I> insert(
+        T&& t, glm::tvec2<F>& p, I root, AABB<F> box, M& onMove) {
       if (n.nodeCount == NOWHERE) {
-        return insertStem(std::move(t), p, n, box);
+        return insertStem(std::move(t), p, n, box, onMove);
       } else if (n.nodeCount == LINK) {
-        return insert(std::move(t), p, n.children[0], box);
+        return insert(std::move(t), p, n.children[0], box, onMove);
       } else if (n.nodeCount < nc) {
-        n.nodes[n.nodeCount] = std::move(t);
-        glm::tvec2<F> ps = gxy(t);
-        n.hash ^= (std::hash<F>{}(ps.x) << 1) ^ std::hash<F>{}(ps.y);
+        place(n, n.nodeCount, std::move(t), p);
+        n.hash ^= hashOf(p);
         ++n.nodeCount;
         return { root, (I) (n.nodeCount - 1) };
       } else if (n.hash != 0) {
@@ -205,11 +998,13 @@ namespace zekku {
         n.children[3] = se;
         n.nodeCount = NOWHERE;
         for (size_t i = 0; i < nc; ++i) {
-          T& sub = n.nodes[i];
-          glm::tvec2<F> ps = gxy(sub);
-          insertStem(std::move(sub), ps, n, box);
+          // Move it out first: splitting a child may reallocate the pool
+          T sub = std::move(n.nodes[i]);
+          glm::tvec2<F> ps = posOf(n, i);
+          Handle<I> to = insertStem(std::move(sub), ps, n, box, onMove);
+          onMove(Handle<I>{root, (I) i}, to);
         }
-        return insertStem(std::move(t), p, n, box);
+        return insertStem(std::move(t), p, n, box, onMove);
       } else {
         // Leaf is full, and chances are:
         // Either all n points are the same, or
@@ -222,90 +1017,120 @@ namespace zekku {
         Node& nwNode = nodes.get(nw);
         nwNode.nodeCount = 0;
         n.children[0] = nw;
-        return insert(std::move(t), p, n.children[0], box);
+        return insert(std::move(t), p, n.children[0], box, onMove);
       }
     }
 #undef n
-    template<typename Q = AABB<T>>
-    void query(
-        const Q& shape, std::vector<Handle<I>>& out,
-        I root, AABB<F> box) const {
-      // Abort if the query shape doesn't intersect the box
-      if (!shape.intersects(box)) return;
-      const Node& n = nodes.get(root);
-      if (n.nodeCount == NOWHERE) {
-        // It is a stem
-        query(shape, out, n.children[0], box.nw());
-        query(shape, out, n.children[1], box.ne());
-        query(shape, out, n.children[2], box.sw());
-        query(shape, out, n.children[3], box.se());
-      } else if (n.nodeCount == LINK) {
-        for (I i = 0; i < nc; ++i) {
-          if (shape.contains(gxy(n.nodes[i])))
-            out.push_back({root, i});
-        }
-        query(shape, out, n.children[0], box);
-      } else {
-        // Leaf
-        for (I i = 0; i < n.nodeCount; ++i) {
-          if (shape.contains(gxy(n.nodes[i])))
-            out.push_back({root, i});
+    struct StackEntry {
+      I node;
+      AABB<F> box;
+    };
+    // The nodes still to visit. It lives on the C++ stack unless the tree
+    // is unusually deep.
+    class TraversalStack {
+    public:
+      TraversalStack() : size(0) {}
+      bool empty() const { return size == 0; }
+      void push(I node, glm::tvec2<F> c, glm::tvec2<F> s) {
+        if (size < INLINE_SIZE) {
+          entries[size] = {node, {c, s}};
+        } else {
+          spill.push_back({node, {c, s}});
         }
+        ++size;
+      }
+      StackEntry pop() {
+        --size;
+        if (size < INLINE_SIZE) return entries[size];
+        StackEntry e = spill.back();
+        spill.pop_back();
+        return e;
       }
+    private:
+      static constexpr size_t INLINE_SIZE = 64;
+      StackEntry entries[INLINE_SIZE];
+      std::vector<StackEntry> spill;
+      size_t size;
+    };
+    // Calls visit(node, index) for each element in shape, in the same
+    // order as a recursive walk (NW, NE, SW, SE). Returns false if visit
+    // returned Traversal::STOP.
+    template<typename Q, typename V>
+    bool traverse(const Q& shape, V& visit) const {
+      if (!shape.intersects(box)) return true;
+      return traverse(shape, root, box, visit);
     }
-    template<typename Q = AABB<T>, typename C>
-    void query(
-        const Q& shape, C callback,
-        I root, AABB<F> box) const {
-      // Abort if the query shape doesn't intersect the box
-      if (!shape.intersects(box)) return;
-      const Node& n = nodes.get(root);
-      if (n.nodeCount == NOWHERE) {
-        // It is a stem
-        query(shape, callback, n.children[0], box.nw());
-        query(shape, callback, n.children[1], box.ne());
-        query(shape, callback, n.children[2], box.sw());
-        query(shape, callback, n.children[3], box.se());
-      } else if (n.nodeCount == LINK) {
-        for (I i = 0; i < nc; ++i) {
-          if (shape.contains(gxy(n.nodes[i])))
-            callback(n.nodes[i]);
+    // Same, for the subtree at node (whose box shape intersects)
+    template<typename Q, typename V>
+    bool traverse(
+        const Q& shape, I node, const AABB<F>& b, V& visit) const {
+      TraversalStack stack;
+      stack.push(node, b.c, b.s);
+      while (!stack.empty()) {
+        StackEntry e = stack.pop();
+        I cur = e.node;
+        const Node* n = &nodes.get(cur);
+        // Overflow chains all share the same box
+        while (n->nodeCount == LINK) {
+          if (!visitLeaf(shape, cur, *n, nc, visit)) return false;
+          cur = n->children[0];
+          n = &nodes.get(cur);
         }
-        query(shape, callback, n.children[0], box);
-      } else {
-        // Leaf
-        for (I i = 0; i < n.nodeCount; ++i) {
-          if (shape.contains(gxy(n.nodes[i])))
-            callback(n.nodes[i]);
+        if (n->nodeCount == NOWHERE) {
+          // Work out the child boxes from this one's centre, and push
+          // them in reverse so that NW comes off first
+          glm::tvec2<F> h = e.box.s * oneHalf<F>;
+          for (size_t c = 4; c > 0; --c) {
+            glm::tvec2<F> cc = {
+              ((c - 1) & 1) != 0 ? e.box.c.x + h.x : e.box.c.x - h.x,
+              ((c - 1) & 2) != 0 ? e.box.c.y + h.y : e.box.c.y - h.y,
+            };
+            if (shape.intersects(AABB<F>{cc, h}))
+              stack.push(n->children[c - 1], cc, h);
+          }
+        } else if (!visitLeaf(shape, cur, *n, n->nodeCount, visit)) {
+          return false;
         }
       }
+      return true;
     }
-    template<typename Q = AABB<T>, typename C>
-    void querym(
-        const Q& shape, C callback,
-        I root, AABB<F> box) {
-      // Abort if the query shape doesn't intersect the box
-      if (!shape.intersects(box)) return;
-      Node& n = nodes.get(root);
-      if (n.nodeCount == NOWHERE) {
-        // It is a stem
-        querym(shape, callback, n.children[0], box.nw());
-        querym(shape, callback, n.children[1], box.ne());
-        querym(shape, callback, n.children[2], box.sw());
-        querym(shape, callback, n.children[3], box.se());
-      } else if (n.nodeCount == LINK) {
-        for (I i = 0; i < nc; ++i) {
-          if (shape.contains(gxy(n.nodes[i])))
-            callback(n.nodes[i]);
-        }
-        querym(shape, callback, n.children[0], box);
-      } else {
-        // Leaf
-        for (I i = 0; i < n.nodeCount; ++i) {
-          if (shape.contains(gxy(n.nodes[i])))
-            callback(n.nodes[i]);
+    struct BatchEntry {
+      I node;
+      AABB<F> box;
+      size_t lo, hi;
+    };
+    template<typename Q>
+    void batchLeaf(
+        const std::vector<Q>& sorted, const std::vector<uint32_t>& ids,
+        const std::vector<uint32_t>& active, const BatchEntry& e,
+        I cur, const Node& n, size_t count,
+        std::vector<QueryHit<I>>& out) const {
+      for (size_t j = e.lo; j < e.hi; ++j) {
+        uint32_t q = active[j];
+        size_t query = ids[q];
+        auto emit = [&out, query](I node, I i) {
+          out.push_back({query, {node, i}});
+          return Traversal::CONTINUE;
+        };
+        visitLeaf(sorted[q], cur, n, count, emit);
+      }
+    }
+    // Tests the first count elements of a leaf up to 64 at a time, and
+    // calls visit on the ones in shape.
+    template<typename Q, typename V>
+    bool visitLeaf(
+        const Q& shape, I cur, const Node& n, size_t count, V& visit) const {
+      for (size_t base = 0; base < count; base += 64) {
+        size_t k = count - base < 64 ? count - base : 64;
+        uint64_t m = LeafKernel<Q, F>::mask(
+          shape, n.xs + base, n.ys + base, k);
+        while (m != 0) {
+          I i = (I) (base + ctz64(m));
+          m &= m - 1;
+          if (visit(cur, i) == Traversal::STOP) return false;
         }
       }
+      return true;
     }
     static void indent(size_t n) {
       for (size_t i = 0; i < n; ++i) std::cerr << ' ';
@@ -335,7 +1160,7 @@ namespace zekku {
         }
         while (n->nodeCount == LINK) {
           for (size_t i = 0; i < nc; ++i) {
-            glm::tvec2<F> p = gxy(n->nodes[i]);
+            glm::tvec2<F> p = posOf(*n, i);
             std::cerr << " (" << p.x << ", " << p.y << ")";
           }
           n = &nodes.get(n->children[0]);
@@ -351,7 +1176,7 @@ namespace zekku {
           }
         } else {
           for (size_t i = 0; i < n->nodeCount; ++i) {
-            glm::tvec2<F> p = gxy(n->nodes[i]);
+            glm::tvec2<F> p = posOf(*n, i);
             std::cerr << " (" << p.x << ", " << p.y << ")";
           }
         }
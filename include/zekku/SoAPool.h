@@ -0,0 +1,225 @@
+#pragma once
+
+#ifndef ZEKKU_SOAPOOL_H
+#define ZEKKU_SOAPOOL_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "zekku/base.h"
+#include "zekku/bitwise.h"
+#include "zekku/Pool.h"
+
+namespace zekku {
+  // Columns are aligned to this many bytes (a cache line), so SIMD loads
+  // of a run that starts on a word boundary are aligned as well.
+  constexpr size_t COLUMN_ALIGN = 64;
+  template<typename T>
+  T* tmallocAligned(size_t elems) {
+    size_t bytes = (elems * sizeof(T) + COLUMN_ALIGN - 1) & ~(COLUMN_ALIGN - 1);
+#ifdef _MSC_VER
+    return (T*) ::_aligned_malloc(bytes, COLUMN_ALIGN);
+#else
+    void* p = nullptr;
+    if (::posix_memalign(&p, COLUMN_ALIGN, bytes) != 0) return nullptr;
+    return (T*) p;
+#endif
+  }
+  inline void freeAligned(void* p) {
+#ifdef _MSC_VER
+    ::_aligned_free(p);
+#else
+    ::free(p);
+#endif
+  }
+  template<typename... Ts>
+  struct AllTriviallyCopyable : std::true_type {};
+  template<typename T, typename... Ts>
+  struct AllTriviallyCopyable<T, Ts...> : std::integral_constant<bool,
+    std::is_trivially_copyable<T>::value &&
+    AllTriviallyCopyable<Ts...>::value> {};
+  /*
+    A pool that stores each field of its elements in a separate column,
+    all sharing one handle space and occupancy bitset.
+    Loops that only touch a few fields then only load those columns.
+    Use `column<k>()` to get the k-th column and `forEachRun` to visit
+    runs of consecutive live slots, which makes a tight loop over
+    each column easy to vectorise.
+  */
+  template<typename Policy, typename... Fields>
+  class BasicSoAPool {
+  public:
+    static_assert(sizeof...(Fields) > 0,
+      "Your pool has no fields, dum dum!");
+    static_assert(AllTriviallyCopyable<Fields...>::value,
+      "Your fields are not trivially copyable, dum dum!");
+    template<size_t k>
+    using Field = typename std::tuple_element<k, std::tuple<Fields...>>::type;
+    BasicSoAPool(size_t c = START_CAPAT) : filled(0),
+        capacity(poolCapacity(c)),
+        columns(tmallocAligned<Fields>(capacity)...),
+        occupied(tmalloc<uint64_t>(occWords(capacity))) {
+      memset(occupied, 0, occWords(capacity) * sizeof(uint64_t));
+      policy.reset(capacity);
+    }
+    ~BasicSoAPool() {
+      freeColumns(std::index_sequence_for<Fields...>());
+      ::free(occupied);
+    }
+    BasicSoAPool(const BasicSoAPool& other) = delete;
+    BasicSoAPool& operator=(const BasicSoAPool& other) = delete;
+    BasicSoAPool(BasicSoAPool&& other) :
+        filled(other.filled), capacity(other.capacity),
+        columns(other.columns), occupied(other.occupied),
+        policy(std::move(other.policy)) {
+      other.filled = 0;
+      other.capacity = START_CAPAT;
+      other.columns = std::make_tuple(tmallocAligned<Fields>(START_CAPAT)...);
+      other.occupied = tmalloc<uint64_t>(occWords(START_CAPAT));
+      memset(other.occupied, 0, occWords(START_CAPAT) * sizeof(uint64_t));
+      other.policy.reset(START_CAPAT);
+    }
+    BasicSoAPool& operator=(BasicSoAPool&& other) {
+      std::swap(filled, other.filled);
+      std::swap(capacity, other.capacity);
+      std::swap(columns, other.columns);
+      std::swap(occupied, other.occupied);
+      std::swap(policy, other.policy);
+      return *this;
+    }
+    template<size_t k>
+    Field<k>& get(size_t handle) {
+      return std::get<k>(columns)[handle];
+    }
+    template<size_t k>
+    const Field<k>& get(size_t handle) const {
+      return std::get<k>(columns)[handle];
+    }
+    // The column may only be indexed with live handles;
+    // it is invalidated when the pool grows.
+    template<size_t k>
+    Field<k>* column() {
+      return std::get<k>(columns);
+    }
+    template<size_t k>
+    const Field<k>* column() const {
+      return std::get<k>(columns);
+    }
+    size_t allocate(const Fields&... values) {
+      size_t bucket = allocateSlot();
+      set(bucket, std::index_sequence_for<Fields...>(), values...);
+      return bucket;
+    }
+    // Allocates an element with every field zeroed.
+    size_t allocate() {
+      size_t bucket = allocateSlot();
+      zero(bucket, std::index_sequence_for<Fields...>());
+      return bucket;
+    }
+    void deallocate(size_t handle) {
+      occReset(occupied, handle);
+      policy.release(handle);
+      --filled;
+    }
+    bool isValid(size_t handle) const {
+      return handle < capacity && occTest(occupied, handle);
+    }
+    size_t size() const { return filled; }
+    size_t getCapacity() const { return capacity; }
+    const uint64_t* occupancy() const { return occupied; }
+    // Calls callback(start, length) for each maximal run of live slots.
+    template<typename C>
+    void forEachRun(C callback) const {
+      size_t runStart = 0, runLength = 0;
+      size_t words = occWords(capacity);
+      for (size_t w = 0; w < words; ++w) {
+        uint64_t bits = occupied[w];
+        size_t base = w << OCC_SHIFT;
+        while (bits != 0) {
+          size_t start = ctz64(bits);
+          uint64_t rest = ~(bits >> start);
+          size_t length = rest == 0 ? OCC_BITS - start : ctz64(rest);
+          if (runLength != 0 && runStart + runLength == base + start) {
+            // Continues the run from the previous word
+            runLength += length;
+          } else {
+            if (runLength != 0) callback(runStart, runLength);
+            runStart = base + start;
+            runLength = length;
+          }
+          if (start + length >= OCC_BITS) break;
+          bits &= ~(uint64_t) 0 << (start + length);
+        }
+      }
+      if (runLength != 0) callback(runStart, runLength);
+    }
+    // Calls callback(handle) for each live element.
+    template<typename C>
+    void forEach(C callback) const {
+      forEachRun([&callback](size_t start, size_t length) {
+        for (size_t i = start; i < start + length; ++i) callback(i);
+      });
+    }
+  private:
+    size_t filled;
+    size_t capacity;
+    std::tuple<Fields*...> columns;
+    uint64_t* occupied;
+    ZK_NOUNIQADDR Policy policy;
+    size_t allocateSlot() {
+      if (policy.shouldExpand(filled, capacity)) expand();
+      size_t bucket = policy.pick(occupied, capacity);
+      ++filled;
+      occSet(occupied, bucket);
+      return bucket;
+    }
+    // C++14 has no fold expressions, so these expand the packs
+    // into a dummy array.
+    template<size_t... ks>
+    void set(
+        size_t handle, std::index_sequence<ks...>,
+        const Fields&... values) {
+      int dummy[] = { 0, ((std::get<ks>(columns)[handle] = values), 0)... };
+      (void) dummy;
+    }
+    template<size_t... ks>
+    void zero(size_t handle, std::index_sequence<ks...>) {
+      int dummy[] = { 0, (memset(
+        (void*) (std::get<ks>(columns) + handle), 0,
+        sizeof(Field<ks>)), 0)... };
+      (void) dummy;
+    }
+    template<size_t... ks>
+    void freeColumns(std::index_sequence<ks...>) {
+      int dummy[] = { 0, (freeAligned(std::get<ks>(columns)), 0)... };
+      (void) dummy;
+    }
+    template<typename F>
+    static void growColumn(F*& column, size_t oldCapacity, size_t newCapacity) {
+      F* newColumn = tmallocAligned<F>(newCapacity);
+      memcpy((void*) newColumn, column, oldCapacity * sizeof(F));
+      freeAligned(column);
+      column = newColumn;
+    }
+    template<size_t... ks>
+    void growColumns(size_t newCapacity, std::index_sequence<ks...>) {
+      int dummy[] = { 0,
+        (growColumn(std::get<ks>(columns), capacity, newCapacity), 0)... };
+      (void) dummy;
+    }
+    void expand() {
+      growColumns(capacity << 1, std::index_sequence_for<Fields...>());
+      occupied = trealloc<uint64_t>(occupied, occWords(capacity << 1));
+      memset(occupied + occWords(capacity), 0,
+        occWords(capacity) * sizeof(uint64_t));
+      policy.grow(capacity, capacity << 1);
+      capacity <<= 1;
+    }
+  };
+  template<typename... Fields>
+  using SoAPool = BasicSoAPool<RandomProbe, Fields...>;
+}
+#endif
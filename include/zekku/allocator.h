@@ -0,0 +1,229 @@
+#pragma once
+
+#ifndef ZEKKU_ALLOCATOR_H
+#define ZEKKU_ALLOCATOR_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+#include "zekku/base.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define ZK_HAS_MMAN 1
+#endif
+
+/*
+  Backing allocators for the element storage of Pool.
+  An allocator is a small copyable object with the following methods:
+
+    void* allocate(size_t bytes);
+    void* reallocate(void* p, size_t oldBytes, size_t newBytes);
+    void deallocate(void* p, size_t bytes);
+
+  `reallocate` may move the block, in which case it behaves like
+  `realloc` (the contents are copied bytewise).
+*/
+
+namespace zekku {
+  // Set for allocators that map a whole range for each allocation. These
+  // suit one big block that grows (FlatStorage), not many small ones.
+  template<typename A>
+  struct MapsPerAllocation : std::false_type {};
+  // Plain old malloc and friends.
+  struct MallocAllocator {
+    void* allocate(size_t bytes) {
+      return ::malloc(bytes);
+    }
+    void* reallocate(void* p, size_t /*oldBytes*/, size_t newBytes) {
+      return ::realloc(p, newBytes);
+    }
+    void deallocate(void* p, size_t /*bytes*/) {
+      ::free(p);
+    }
+  };
+  // ------------------
+  // A bump allocator whose memory is all released at once by
+  // `clear` or by its destructor, for example at the end of a level.
+  // Individual deallocations are ignored.
+  class Arena {
+  public:
+    static constexpr size_t ALIGN = alignof(std::max_align_t);
+    Arena(size_t chunkSize = (size_t) 1 << 20) :
+        chunkSize(chunkSize), top(nullptr), left(0), last(nullptr) {}
+    ~Arena() { clear(); }
+    Arena(const Arena& other) = delete;
+    Arena& operator=(const Arena& other) = delete;
+    void* allocate(size_t bytes) {
+      bytes = roundUp(bytes);
+      if (bytes > left) {
+        size_t size = std::max(chunkSize, bytes);
+        top = (char*) ::malloc(size);
+        chunks.push_back(top);
+        left = size;
+      }
+      last = top;
+      top += bytes;
+      left -= bytes;
+      return last;
+    }
+    // Resizes the most recent allocation in place if there is room,
+    // giving back what it shrinks by. Other allocations stay where they
+    // are when they shrink.
+    void* reallocate(void* p, size_t oldBytes, size_t newBytes) {
+      if (p != nullptr && p == last) {
+        size_t used = (size_t) (top - last);
+        size_t wanted = roundUp(newBytes);
+        if (wanted <= used) {
+          top = last + wanted;
+          left += used - wanted;
+          return p;
+        }
+        if (wanted - used <= left) {
+          top += wanted - used;
+          left -= wanted - used;
+          return p;
+        }
+      } else if (p != nullptr && newBytes <= oldBytes) {
+        return p;
+      }
+      void* q = allocate(newBytes);
+      if (p != nullptr) memcpy(q, p, std::min(oldBytes, newBytes));
+      return q;
+    }
+    void deallocate(void* /*p*/, size_t /*bytes*/) {}
+    // Frees everything allocated from this arena.
+    void clear() {
+      for (char* chunk : chunks) ::free(chunk);
+      chunks.clear();
+      top = last = nullptr;
+      left = 0;
+    }
+  private:
+    static size_t roundUp(size_t bytes) {
+      return (bytes + ALIGN - 1) & ~(ALIGN - 1);
+    }
+    size_t chunkSize;
+    char* top;
+    size_t left;
+    char* last;
+    std::vector<char*> chunks;
+  };
+  // Has to be given an arena, which must outlive everything allocated
+  // from it.
+  struct ArenaAllocator {
+    explicit ArenaAllocator(Arena& arena) : arena(&arena) {}
+    void* allocate(size_t bytes) {
+      return arena->allocate(bytes);
+    }
+    void* reallocate(void* p, size_t oldBytes, size_t newBytes) {
+      return arena->reallocate(p, oldBytes, newBytes);
+    }
+    void deallocate(void* p, size_t bytes) {
+      arena->deallocate(p, bytes);
+    }
+    Arena* arena;
+  };
+#ifdef ZK_HAS_MMAN
+  // ------------------
+  // Maps memory in 2 MB huge pages to cut down on TLB misses for large
+  // pools. Falls back to transparent huge pages (or ordinary pages)
+  // when no huge pages are reserved on the system.
+  struct HugePageAllocator {
+    static constexpr size_t HUGE_PAGE = (size_t) 2 << 20;
+    void* allocate(size_t bytes) {
+      size_t size = roundUp(bytes);
+      void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+      p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+      if (p == MAP_FAILED) {
+        p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return nullptr;
+#ifdef MADV_HUGEPAGE
+        ::madvise(p, size, MADV_HUGEPAGE);
+#endif
+      }
+      return p;
+    }
+    void* reallocate(void* p, size_t oldBytes, size_t newBytes) {
+      if (p == nullptr) return allocate(newBytes);
+      if (roundUp(oldBytes) == roundUp(newBytes)) return p;
+#ifdef MREMAP_MAYMOVE
+      // Moves the page table entries instead of copying the contents
+      void* q = ::mremap(p, roundUp(oldBytes), roundUp(newBytes),
+        MREMAP_MAYMOVE);
+      if (q != MAP_FAILED) return q;
+#endif
+      void* q2 = allocate(newBytes);
+      if (q2 == nullptr) return nullptr;
+      memcpy(q2, p, std::min(oldBytes, newBytes));
+      deallocate(p, oldBytes);
+      return q2;
+    }
+    void deallocate(void* p, size_t bytes) {
+      if (p != nullptr) ::munmap(p, roundUp(bytes));
+    }
+    static size_t roundUp(size_t bytes) {
+      return (std::max<size_t>(bytes, 1) + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+    }
+  };
+  template<>
+  struct MapsPerAllocation<HugePageAllocator> : std::true_type {};
+  // ------------------
+  // Reserves a large range of address space up front and commits pages
+  // from it as the block grows, so growing never moves or copies
+  // anything. Each allocation may be at most `reserveBytes` long.
+  struct ReservedAllocator {
+    ReservedAllocator(size_t reserveBytes = (size_t) 1 << 32) :
+      reserveBytes(reserveBytes) {}
+    void* allocate(size_t bytes) {
+      if (bytes > reserveBytes) return nullptr;
+      void* p = ::mmap(nullptr, reserveBytes, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (p == MAP_FAILED) return nullptr;
+      if (bytes != 0 &&
+          ::mprotect(p, roundUp(bytes), PROT_READ | PROT_WRITE) != 0) {
+        ::munmap(p, reserveBytes);
+        return nullptr;
+      }
+      return p;
+    }
+    void* reallocate(void* p, size_t oldBytes, size_t newBytes) {
+      if (p == nullptr) return allocate(newBytes);
+      if (newBytes > reserveBytes) return nullptr;
+      size_t oldSize = roundUp(oldBytes);
+      size_t newSize = roundUp(newBytes);
+      if (newSize > oldSize) {
+        if (::mprotect((char*) p + oldSize, newSize - oldSize,
+            PROT_READ | PROT_WRITE) != 0)
+          return nullptr;
+      } else if (newSize < oldSize) {
+        // Give the pages back, but keep the address range
+        ::madvise((char*) p + newSize, oldSize - newSize, MADV_DONTNEED);
+        ::mprotect((char*) p + newSize, oldSize - newSize, PROT_NONE);
+      }
+      return p;
+    }
+    void deallocate(void* p, size_t /*bytes*/) {
+      if (p != nullptr) ::munmap(p, reserveBytes);
+    }
+    static size_t roundUp(size_t bytes) {
+      size_t page = (size_t) ::sysconf(_SC_PAGESIZE);
+      return (bytes + page - 1) & ~(page - 1);
+    }
+    size_t reserveBytes;
+  };
+  template<>
+  struct MapsPerAllocation<ReservedAllocator> : std::true_type {};
+#endif
+}
+
+#endif
@@ -30,6 +30,35 @@ namespace zekku {
     v |= v >> 16;
     return 1 + MultiplyDeBruijnBitPosition[(uint32_t)(v * 0x07C4ACDDU) >> 27];
   }
+  // Index of the lowest / highest set bit. v must not be zero.
+  inline int ctz64(uint64_t v) {
+#ifdef __GNUC__
+    return __builtin_ctzll(v);
+#else
+    int n = 0;
+    while ((v & 1) == 0) { v >>= 1; ++n; }
+    return n;
+#endif
+  }
+  inline int highestBit64(uint64_t v) {
+#ifdef __GNUC__
+    return 63 - __builtin_clzll(v);
+#else
+    int n = 0;
+    while (v >>= 1) ++n;
+    return n;
+#endif
+  }
+  inline int popcount64(uint64_t v) {
+#ifdef __GNUC__
+    return __builtin_popcountll(v);
+#else
+    v = v - ((v >> 1) & 0x5555555555555555ULL);
+    v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+    v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (int) ((v * 0x0101010101010101ULL) >> 56);
+#endif
+  }
 }
 
 #endif
\ No newline at end of file
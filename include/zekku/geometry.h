@@ -166,6 +166,46 @@ namespace zekku {
   bool Circle<F>::intersects(const Line<F>& l) const {
     return l.intersects(*this);
   }
+  // Where a query shape is, for putting shapes in spatial order.
+  // Other shapes can overload this.
+  template<typename F>
+  glm::tvec2<F> centreOf(const AABB<F>& b) {
+    return b.c;
+  }
+  template<typename F>
+  glm::tvec2<F> centreOf(const Circle<F>& c) {
+    return c.c;
+  }
+  // Morton key of p in box: levels (at most 16) quadrant digits from
+  // getClass, most significant first. Points outside box get the key of
+  // the nearest cell.
+  template<typename F>
+  uint32_t mortonKey(const AABB<F>& box, glm::tvec2<F> p, size_t levels) {
+    uint32_t k = 0;
+    AABB<F> b = box;
+    for (size_t level = 0; level < levels; ++level) {
+      uint32_t c = (uint32_t) b.getClass(p);
+      k = (k << 2) | c;
+      b = b.getSubboxByClass(c);
+    }
+    return k;
+  }
+  // The box twice the size of b that has b as one of its quadrants and
+  // reaches out towards p. Sets quadrant to the class of b in it.
+  template<typename F>
+  AABB<F> growToward(
+      const AABB<F>& b, glm::tvec2<F> p, uint32_t& quadrant) {
+    bool west = p.x < b.c.x;
+    bool north = p.y < b.c.y;
+    quadrant = (north ? 2 : 0) | (west ? 1 : 0);
+    return {
+      {
+        west ? b.c.x - b.s.x : b.c.x + b.s.x,
+        north ? b.c.y - b.s.y : b.c.y + b.s.y,
+      },
+      b.s + b.s
+    };
+  }
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,121 @@
+#pragma once
+
+#ifndef ZEKKU_KFP_INTEROP_SIMD_H
+#define ZEKKU_KFP_INTEROP_SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <kozet_fixed_point/kfp.h>
+#include <kozet_fixed_point/kfp_extra.h>
+#include "zekku/bitwise.h"
+#include "zekku/simd.h"
+#include "zekku/kfp_interop/timath.h"
+
+namespace zekku {
+  // 32-bit fixed-point coordinates are compared as plain integers.
+#if defined(ZK_SSE2)
+  template<size_t d>
+  struct LeafKernel<AABB<kfp::Fixed<int32_t, d>>, kfp::Fixed<int32_t, d>> {
+    using F = kfp::Fixed<int32_t, d>;
+    static uint64_t mask(
+        const AABB<F>& shape, const F* xs, const F* ys, size_t count) {
+      const int32_t* x = &xs[0].underlying;
+      const int32_t* y = &ys[0].underlying;
+      uint64_t m = 0;
+#if defined(ZK_AVX2)
+      __m256i x0 = _mm256_set1_epi32((shape.c.x - shape.s.x).underlying);
+      __m256i x1 = _mm256_set1_epi32((shape.c.x + shape.s.x).underlying);
+      __m256i y0 = _mm256_set1_epi32((shape.c.y - shape.s.y).underlying);
+      __m256i y1 = _mm256_set1_epi32((shape.c.y + shape.s.y).underlying);
+      for (size_t i = 0; i < count; i += 8) {
+        __m256i px = _mm256_loadu_si256((const __m256i*) (x + i));
+        __m256i py = _mm256_loadu_si256((const __m256i*) (y + i));
+        __m256i out = _mm256_or_si256(
+          _mm256_or_si256(
+            _mm256_cmpgt_epi32(x0, px), _mm256_cmpgt_epi32(px, x1)),
+          _mm256_or_si256(
+            _mm256_cmpgt_epi32(y0, py), _mm256_cmpgt_epi32(py, y1)));
+        uint32_t bits = _mm256_movemask_ps(_mm256_castsi256_ps(out));
+        m |= (uint64_t) (~bits & 0xFF) << i;
+      }
+#else
+      __m128i x0 = _mm_set1_epi32((shape.c.x - shape.s.x).underlying);
+      __m128i x1 = _mm_set1_epi32((shape.c.x + shape.s.x).underlying);
+      __m128i y0 = _mm_set1_epi32((shape.c.y - shape.s.y).underlying);
+      __m128i y1 = _mm_set1_epi32((shape.c.y + shape.s.y).underlying);
+      for (size_t i = 0; i < count; i += 4) {
+        __m128i px = _mm_loadu_si128((const __m128i*) (x + i));
+        __m128i py = _mm_loadu_si128((const __m128i*) (y + i));
+        __m128i out = _mm_or_si128(
+          _mm_or_si128(_mm_cmpgt_epi32(x0, px), _mm_cmpgt_epi32(px, x1)),
+          _mm_or_si128(_mm_cmpgt_epi32(y0, py), _mm_cmpgt_epi32(py, y1)));
+        uint32_t bits = _mm_movemask_ps(_mm_castsi128_ps(out));
+        m |= (uint64_t) (~bits & 0xF) << i;
+      }
+#endif
+      return m & lowBits(count);
+    }
+  };
+#endif
+#if defined(ZK_AVX2)
+  // Squared distances need 64 bits, so the even and odd lanes are
+  // squared separately, from their absolute values (which then fit in an
+  // unsigned 32-bit multiply). The sum of two squares fits in an
+  // unsigned 64-bit integer, which is compared with a signed compare by
+  // flipping the top bit. Points right on the edge are left to
+  // kfp::isInterior, so this agrees with it on which side the edge is.
+  template<size_t d>
+  struct LeafKernel<Circle<kfp::Fixed<int32_t, d>>, kfp::Fixed<int32_t, d>> {
+    using F = kfp::Fixed<int32_t, d>;
+    static uint64_t mask(
+        const Circle<F>& shape, const F* xs, const F* ys, size_t count) {
+      if (shape.r.underlying < 0) {
+        return scalarLeafMask(shape, xs, ys, count);
+      }
+      const int32_t* x = &xs[0].underlying;
+      const int32_t* y = &ys[0].underlying;
+      __m256i cx = _mm256_set1_epi32(shape.c.x.underlying);
+      __m256i cy = _mm256_set1_epi32(shape.c.y.underlying);
+      uint64_t r = (uint64_t) shape.r.underlying;
+      __m256i flip = _mm256_set1_epi64x(INT64_MIN);
+      __m256i r2 = _mm256_xor_si256(_mm256_set1_epi64x(r * r), flip);
+      uint64_t inside = 0, edge = 0;
+      for (size_t i = 0; i < count; i += 8) {
+        __m256i dx = _mm256_abs_epi32(_mm256_sub_epi32(
+          cx, _mm256_loadu_si256((const __m256i*) (x + i))));
+        __m256i dy = _mm256_abs_epi32(_mm256_sub_epi32(
+          cy, _mm256_loadu_si256((const __m256i*) (y + i))));
+        uint32_t lt[2], eq[2];
+        for (int odd = 0; odd < 2; ++odd) {
+          __m256i ex = odd ? _mm256_srli_epi64(dx, 32) : dx;
+          __m256i ey = odd ? _mm256_srli_epi64(dy, 32) : dy;
+          __m256i d2 = _mm256_xor_si256(_mm256_add_epi64(
+            _mm256_mul_epu32(ex, ex), _mm256_mul_epu32(ey, ey)), flip);
+          lt[odd] = _mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpgt_epi64(r2, d2)));
+          eq[odd] = _mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpeq_epi64(r2, d2)));
+        }
+        inside |= (uint64_t) (spread(lt[0]) | (spread(lt[1]) << 1)) << i;
+        edge |= (uint64_t) (spread(eq[0]) | (spread(eq[1]) << 1)) << i;
+      }
+      edge &= lowBits(count);
+      while (edge != 0) {
+        size_t i = ctz64(edge);
+        edge &= edge - 1;
+        if (shape.contains(glm::tvec2<F>{xs[i], ys[i]}))
+          inside |= uint64_t(1) << i;
+      }
+      return inside & lowBits(count);
+    }
+  private:
+    // Moves bit i of a 4-bit mask to bit 2i
+    static uint32_t spread(uint32_t m) {
+      return (m & 1) | ((m & 2) << 1) | ((m & 4) << 2) | ((m & 8) << 3);
+    }
+  };
+#endif
+}
+
+#endif
@@ -0,0 +1,188 @@
+#pragma once
+
+#ifndef ZEKKU_PARALLEL_H
+#define ZEKKU_PARALLEL_H
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "zekku/base.h"
+#include "zekku/QuadTree.h"
+
+namespace zekku {
+  /*
+    A fixed set of threads to split work over.
+    The thread that calls run works too, as worker 0, so a pool of one
+    worker runs everything on the calling thread.
+    Only one thread may call run at a time.
+  */
+  class WorkerPool {
+  public:
+    static size_t defaultWorkers() {
+      size_t n = std::thread::hardware_concurrency();
+      return n == 0 ? 1 : n;
+    }
+    explicit WorkerPool(size_t workers = defaultWorkers()) :
+        nWorkers(workers == 0 ? 1 : workers) {
+      for (size_t w = 1; w < nWorkers; ++w)
+        threads.emplace_back([this, w]() { loop(w); });
+    }
+    ~WorkerPool() {
+      {
+        std::lock_guard<std::mutex> lock(m);
+        quitting = true;
+      }
+      wake.notify_all();
+      for (std::thread& t : threads) t.join();
+    }
+    WorkerPool(const WorkerPool& other) = delete;
+    WorkerPool& operator=(const WorkerPool& other) = delete;
+    size_t size() const { return nWorkers; }
+    // Calls f(begin, end, worker) on chunks of [0, count) of grain indices
+    // each (the last may be shorter), and returns once all of them are
+    // done. Workers take the next chunk whenever they finish one.
+    // f must not throw.
+    template<typename C>
+    void run(size_t count, size_t grain, const C& f) {
+      if (count == 0) return;
+      {
+        std::lock_guard<std::mutex> lock(m);
+        job = &f;
+        call = &callJob<C>;
+        jobCount = count;
+        jobGrain = grain == 0 ? 1 : grain;
+        next.store(0, std::memory_order_relaxed);
+        busy = nWorkers - 1;
+        ++generation;
+      }
+      wake.notify_all();
+      work(0);
+      std::unique_lock<std::mutex> lock(m);
+      done.wait(lock, [this]() { return busy == 0; });
+    }
+  private:
+    size_t nWorkers;
+    std::vector<std::thread> threads;
+    std::mutex m;
+    std::condition_variable wake, done;
+    // The rest is guarded by m, except next
+    const void* job = nullptr;
+    void (*call)(const void*, size_t, size_t, size_t) = nullptr;
+    size_t jobCount = 0, jobGrain = 1;
+    std::atomic<size_t> next{0};
+    size_t busy = 0;
+    uint64_t generation = 0;
+    bool quitting = false;
+    template<typename C>
+    static void callJob(
+        const void* f, size_t begin, size_t end, size_t worker) {
+      (*static_cast<const C*>(f))(begin, end, worker);
+    }
+    void work(size_t worker) {
+      while (true) {
+        size_t begin = next.fetch_add(jobGrain, std::memory_order_relaxed);
+        if (begin >= jobCount) return;
+        size_t end = std::min(begin + jobGrain, jobCount);
+        call(job, begin, end, worker);
+      }
+    }
+    void loop(size_t worker) {
+      uint64_t seen = 0;
+      while (true) {
+        {
+          std::unique_lock<std::mutex> lock(m);
+          wake.wait(lock, [this, seen]() {
+            return quitting || generation != seen;
+          });
+          if (quitting) return;
+          seen = generation;
+        }
+        work(worker);
+        std::lock_guard<std::mutex> lock(m);
+        if (--busy == 0) done.notify_one();
+      }
+    }
+  };
+  // Queries handed to a worker at a time by parallelQuery
+  constexpr size_t PARALLEL_QUERY_GRAIN = 256;
+  /*
+    Runs tree.query(shapes[i], ...) for every i, spread over the workers
+    in pool, and appends a hit {i, handle} to out for each element found.
+    Hits are in the same order as running the queries one by one.
+    Each worker collects hits in its own buffer, and the buffers are
+    copied into out at the end.
+    Tree can be any tree whose query(shape, std::vector<HandleType>&) is
+    safe to call from many threads at once (all of them are, as long as
+    nothing modifies the tree meanwhile).
+  */
+  template<typename Tree, typename Q>
+  void parallelQuery(
+      WorkerPool& pool, const Tree& tree, const std::vector<Q>& shapes,
+      std::vector<BasicQueryHit<typename Tree::HandleType>>& out,
+      size_t grain = PARALLEL_QUERY_GRAIN) {
+    using H = typename Tree::HandleType;
+    using Hit = BasicQueryHit<H>;
+    struct Segment {
+      size_t chunk, begin, end; // Hits [begin, end) of the worker's buffer
+    };
+    struct WorkerState {
+      std::vector<Hit> hits;
+      std::vector<Segment> segments;
+      std::vector<H> scratch;
+      char pad[64]; // Keep workers off each other's cache lines
+    };
+    if (grain == 0) grain = 1;
+    std::vector<WorkerState> states(pool.size());
+    pool.run(shapes.size(), grain,
+      [&](size_t begin, size_t end, size_t worker) {
+        WorkerState& st = states[worker];
+        size_t start = st.hits.size();
+        for (size_t i = begin; i < end; ++i) {
+          st.scratch.clear();
+          tree.query(shapes[i], st.scratch);
+          for (const H& h : st.scratch) st.hits.push_back({i, h});
+        }
+        st.segments.push_back({begin / grain, start, st.hits.size()});
+      });
+    // Put the chunks back in order
+    size_t nChunks = (shapes.size() + grain - 1) / grain;
+    std::vector<std::pair<const WorkerState*, const Segment*>>
+      chunks(nChunks);
+    for (const WorkerState& st : states) {
+      for (const Segment& s : st.segments) chunks[s.chunk] = {&st, &s};
+    }
+    size_t total = out.size();
+    for (const auto& c : chunks) total += c.second->end - c.second->begin;
+    out.reserve(total);
+    for (const auto& c : chunks) {
+      out.insert(out.end(),
+        c.first->hits.begin() + c.second->begin,
+        c.first->hits.begin() + c.second->end);
+    }
+  }
+  /*
+    Same, but calls callback(i, elem, worker) for each element in
+    shapes[i] instead, from whichever worker ran the query. The callback
+    has to be safe to call from many threads at once; worker is less
+    than pool.size(), for keeping results per worker.
+  */
+  template<typename Tree, typename Q, typename C>
+  void parallelQuery(
+      WorkerPool& pool, const Tree& tree, const std::vector<Q>& shapes,
+      C callback, size_t grain = PARALLEL_QUERY_GRAIN) {
+    pool.run(shapes.size(), grain,
+      [&](size_t begin, size_t end, size_t worker) {
+        for (size_t i = begin; i < end; ++i) {
+          tree.query(shapes[i], [&callback, i, worker](const auto& t) {
+            callback(i, t, worker);
+          });
+        }
+      });
+  }
+}
+
+#endif
@@ -0,0 +1,197 @@
+#pragma once
+
+#ifndef ZEKKU_SIMD_H
+#define ZEKKU_SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <glm/glm.hpp>
+#include "zekku/base.h"
+#include "zekku/geometry.h"
+
+// Define ZK_NO_SIMD to get the plain scalar loops everywhere.
+#ifndef ZK_NO_SIMD
+#if defined(__AVX512F__)
+#define ZK_AVX512 1
+#endif
+#if defined(__AVX2__)
+#define ZK_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#define ZK_SSE2 1
+#endif
+#endif
+
+#if defined(ZK_AVX2) || defined(ZK_AVX512)
+#include <immintrin.h>
+#elif defined(ZK_SSE2)
+#include <emmintrin.h>
+#endif
+
+namespace zekku {
+  // Leaves keep the coordinates of their elements in arrays padded to a
+  // multiple of this, so that kernels can always load whole vectors.
+  constexpr size_t LEAF_LANES = 16;
+  constexpr size_t padToLanes(size_t n) {
+    return (n + LEAF_LANES - 1) / LEAF_LANES * LEAF_LANES;
+  }
+  inline uint64_t lowBits(size_t count) {
+    return count >= 64 ? ~uint64_t(0) : (uint64_t(1) << count) - 1;
+  }
+  // One contains call per point
+  template<typename Q, typename F>
+  uint64_t scalarLeafMask(
+      const Q& shape, const F* xs, const F* ys, size_t count) {
+    uint64_t m = 0;
+    for (size_t i = 0; i < count; ++i) {
+      if (shape.contains(glm::tvec2<F>{xs[i], ys[i]}))
+        m |= uint64_t(1) << i;
+    }
+    return m;
+  }
+  // Tests count (at most 64) points at once against a query shape,
+  // returning a mask with bit i set if (xs[i], ys[i]) is in it.
+  // xs and ys must be readable up to padToLanes(count).
+  // Specialisations have to give the same answers as shape.contains.
+  template<typename Q, typename F>
+  struct LeafKernel {
+    static uint64_t mask(
+        const Q& shape, const F* xs, const F* ys, size_t count) {
+      return scalarLeafMask(shape, xs, ys, count);
+    }
+  };
+  // The kernels below square and add with separate instructions, as
+  // contains does, so that they round the same way.
+#if defined(ZK_AVX512)
+  template<>
+  struct LeafKernel<Circle<float>, float> {
+    static uint64_t mask(
+        const Circle<float>& shape,
+        const float* xs, const float* ys, size_t count) {
+      __m512 cx = _mm512_set1_ps(shape.c.x);
+      __m512 cy = _mm512_set1_ps(shape.c.y);
+      __m512 r2 = _mm512_set1_ps(shape.r * shape.r);
+      uint64_t m = 0;
+      for (size_t i = 0; i < count; i += 16) {
+        __m512 dx = _mm512_sub_ps(cx, _mm512_loadu_ps(xs + i));
+        __m512 dy = _mm512_sub_ps(cy, _mm512_loadu_ps(ys + i));
+        __m512 d2 = _mm512_add_ps(
+          _mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy));
+        m |= (uint64_t) _mm512_cmp_ps_mask(d2, r2, _CMP_LE_OQ) << i;
+      }
+      return m & lowBits(count);
+    }
+  };
+  template<>
+  struct LeafKernel<AABB<float>, float> {
+    static uint64_t mask(
+        const AABB<float>& shape,
+        const float* xs, const float* ys, size_t count) {
+      __m512 x0 = _mm512_set1_ps(shape.c.x - shape.s.x);
+      __m512 x1 = _mm512_set1_ps(shape.c.x + shape.s.x);
+      __m512 y0 = _mm512_set1_ps(shape.c.y - shape.s.y);
+      __m512 y1 = _mm512_set1_ps(shape.c.y + shape.s.y);
+      uint64_t m = 0;
+      for (size_t i = 0; i < count; i += 16) {
+        __m512 x = _mm512_loadu_ps(xs + i);
+        __m512 y = _mm512_loadu_ps(ys + i);
+        __mmask16 in =
+          _mm512_cmp_ps_mask(x, x0, _CMP_GE_OQ) &
+          _mm512_cmp_ps_mask(x, x1, _CMP_LE_OQ) &
+          _mm512_cmp_ps_mask(y, y0, _CMP_GE_OQ) &
+          _mm512_cmp_ps_mask(y, y1, _CMP_LE_OQ);
+        m |= (uint64_t) in << i;
+      }
+      return m & lowBits(count);
+    }
+  };
+#elif defined(ZK_AVX2)
+  template<>
+  struct LeafKernel<Circle<float>, float> {
+    static uint64_t mask(
+        const Circle<float>& shape,
+        const float* xs, const float* ys, size_t count) {
+      __m256 cx = _mm256_set1_ps(shape.c.x);
+      __m256 cy = _mm256_set1_ps(shape.c.y);
+      __m256 r2 = _mm256_set1_ps(shape.r * shape.r);
+      uint64_t m = 0;
+      for (size_t i = 0; i < count; i += 8) {
+        __m256 dx = _mm256_sub_ps(cx, _mm256_loadu_ps(xs + i));
+        __m256 dy = _mm256_sub_ps(cy, _mm256_loadu_ps(ys + i));
+        __m256 d2 = _mm256_add_ps(
+          _mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+        __m256 in = _mm256_cmp_ps(d2, r2, _CMP_LE_OQ);
+        m |= (uint64_t) _mm256_movemask_ps(in) << i;
+      }
+      return m & lowBits(count);
+    }
+  };
+  template<>
+  struct LeafKernel<AABB<float>, float> {
+    static uint64_t mask(
+        const AABB<float>& shape,
+        const float* xs, const float* ys, size_t count) {
+      __m256 x0 = _mm256_set1_ps(shape.c.x - shape.s.x);
+      __m256 x1 = _mm256_set1_ps(shape.c.x + shape.s.x);
+      __m256 y0 = _mm256_set1_ps(shape.c.y - shape.s.y);
+      __m256 y1 = _mm256_set1_ps(shape.c.y + shape.s.y);
+      uint64_t m = 0;
+      for (size_t i = 0; i < count; i += 8) {
+        __m256 x = _mm256_loadu_ps(xs + i);
+        __m256 y = _mm256_loadu_ps(ys + i);
+        __m256 in = _mm256_and_ps(
+          _mm256_and_ps(
+            _mm256_cmp_ps(x, x0, _CMP_GE_OQ),
+            _mm256_cmp_ps(x, x1, _CMP_LE_OQ)),
+          _mm256_and_ps(
+            _mm256_cmp_ps(y, y0, _CMP_GE_OQ),
+            _mm256_cmp_ps(y, y1, _CMP_LE_OQ)));
+        m |= (uint64_t) _mm256_movemask_ps(in) << i;
+      }
+      return m & lowBits(count);
+    }
+  };
+#elif defined(ZK_SSE2)
+  template<>
+  struct LeafKernel<Circle<float>, float> {
+    static uint64_t mask(
+        const Circle<float>& shape,
+        const float* xs, const float* ys, size_t count) {
+      __m128 cx = _mm_set1_ps(shape.c.x);
+      __m128 cy = _mm_set1_ps(shape.c.y);
+      __m128 r2 = _mm_set1_ps(shape.r * shape.r);
+      uint64_t m = 0;
+      for (size_t i = 0; i < count; i += 4) {
+        __m128 dx = _mm_sub_ps(cx, _mm_loadu_ps(xs + i));
+        __m128 dy = _mm_sub_ps(cy, _mm_loadu_ps(ys + i));
+        __m128 d2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+        m |= (uint64_t) _mm_movemask_ps(_mm_cmple_ps(d2, r2)) << i;
+      }
+      return m & lowBits(count);
+    }
+  };
+  template<>
+  struct LeafKernel<AABB<float>, float> {
+    static uint64_t mask(
+        const AABB<float>& shape,
+        const float* xs, const float* ys, size_t count) {
+      __m128 x0 = _mm_set1_ps(shape.c.x - shape.s.x);
+      __m128 x1 = _mm_set1_ps(shape.c.x + shape.s.x);
+      __m128 y0 = _mm_set1_ps(shape.c.y - shape.s.y);
+      __m128 y1 = _mm_set1_ps(shape.c.y + shape.s.y);
+      uint64_t m = 0;
+      for (size_t i = 0; i < count; i += 4) {
+        __m128 x = _mm_loadu_ps(xs + i);
+        __m128 y = _mm_loadu_ps(ys + i);
+        __m128 in = _mm_and_ps(
+          _mm_and_ps(_mm_cmpge_ps(x, x0), _mm_cmple_ps(x, x1)),
+          _mm_and_ps(_mm_cmpge_ps(y, y0), _mm_cmple_ps(y, y1)));
+        m |= (uint64_t) _mm_movemask_ps(in) << i;
+      }
+      return m & lowBits(count);
+    }
+  };
+#endif
+}
+
+#endif
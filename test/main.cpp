@@ -5,14 +5,23 @@
 #include <algorithm>
 #include <chrono>
 #include <iostream>
+#include <memory>
 #include <random>
+#include <mutex>
 #include <set>
+#include <string>
+#include <thread>
 
 #include <kozet_fixed_point/kfp.h>
 #include <kozet_fixed_point/kfp_extra.h>
 #include "zekku/Pool.h"
+#include "zekku/ConcurrentPool.h"
+#include "zekku/SoAPool.h"
 #include "zekku/QuadTree.h"
+#include "zekku/LinearQuadTree.h"
 #include "zekku/BoxQuadTree.h"
+#include "zekku/parallel.h"
+#include "zekku/kfp_interop/simd.h"
 #include "zekku/kfp_interop/timath.h"
 
 struct Options {
@@ -44,6 +53,552 @@ void testPool() {
     if (val != 35 * i)
       printf("i = %zu: got %zu, expected %zu\n", i, val, 35 * i);
   }
+  // Capacities that aren't powers of two are rounded up
+  zekku::Pool<int> odd(100);
+  if (odd.getCapacity() != 128)
+    printf("Pool(100) has capacity %zu\n", odd.getCapacity());
+  for (int i = 0; i < 100; ++i) odd.get(odd.allocate(i)) += 1;
+  if (odd.size() != 100) printf("Pool(100) lost elements\n");
+}
+
+void testPoolFreeList() {
+  std::cerr << "Testing free-list pool...\n";
+  zekku::Pool<size_t, zekku::FreeList> p;
+  bool ok = true;
+  for (size_t i = 0; i < hc; ++i) {
+    size_t h = p.allocate(35 * i);
+    // Handles from a fresh free-list pool are handed out in order
+    if (h != i) ok = false;
+  }
+  p.deallocate(17);
+  p.deallocate(42);
+  // ... and the most recently freed one is reused first
+  if (p.allocate() != 42 || p.allocate() != 17) ok = false;
+  for (size_t i = 0; i < hc; ++i) {
+    if (i == 17 || i == 42) continue;
+    if (p.get(i) != 35 * i) ok = false;
+  }
+  if (ok) std::cerr << "Handles are deterministic :)\n";
+  else std::cerr << "Free-list pool returned unexpected handles!\n";
+}
+
+// Churn a pool held at a given fill level: free a random live handle
+// and allocate a new one, over and over.
+template<typename Policy>
+size_t benchPoolChurn(double fill) {
+  constexpr size_t capacity = 1 << 16;
+  constexpr size_t churns = 1 << 22;
+  zekku::Pool<size_t, Policy> p(capacity);
+  size_t live = (size_t) (fill * capacity);
+  std::vector<size_t> handles(live);
+  for (size_t i = 0; i < live; ++i) handles[i] = p.allocate(i);
+  std::mt19937_64 r(12345);
+  using namespace std::chrono;
+  auto ms = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  for (size_t i = 0; i < churns; ++i) {
+    size_t& h = handles[r() % live];
+    p.deallocate(h);
+    h = p.allocate(i);
+  }
+  auto ms2 = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  return (ms2 - ms).count();
+}
+
+void benchPool() {
+  std::cerr << "Benchmarking pool allocation policies...\n";
+  const double fills[] = { 0.1, 0.25, 0.5, 0.7 };
+  for (double fill : fills) {
+    size_t random = benchPoolChurn<zekku::RandomProbe>(fill);
+    size_t freeList = benchPoolChurn<zekku::FreeList>(fill);
+    fprintf(stderr,
+      "%2.0f%% full: random probe %zu ms, free list %zu ms\n",
+      100 * fill, random, freeList);
+  }
+}
+
+void testPoolIteration() {
+  std::cerr << "Testing sparse pool iteration...\n";
+  constexpr size_t capacity = 1 << 20;
+  zekku::Pool<size_t, zekku::FreeList> p(capacity);
+  std::mt19937_64 r(54321);
+  for (size_t i = 0; i < capacity * 3 / 4; ++i) p.allocate(i);
+  // Leave about 1% of the slots alive
+  size_t expectedSum = 0, expectedCount = 0;
+  for (size_t i = 0; i < capacity * 3 / 4; ++i) {
+    if (r() % 100 != 0) {
+      p.deallocate(i);
+    } else {
+      expectedSum += i;
+      ++expectedCount;
+    }
+  }
+  size_t sum = 0, count = 0;
+  using namespace std::chrono;
+  auto ms = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  constexpr size_t iters = 1000;
+  for (size_t j = 0; j < iters; ++j) {
+    for (size_t x : p) {
+      sum += x;
+      ++count;
+    }
+  }
+  auto ms2 = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  if (sum != iters * expectedSum || count != iters * expectedCount) {
+    fprintf(stderr, "Iterated over %zu elements (%zu expected)\n",
+      count / iters, expectedCount);
+  } else {
+    fprintf(stderr,
+      "Done! %zu passes over %zu live elements taking %zu ms.\n",
+      iters, expectedCount, (size_t) (ms2 - ms).count());
+  }
+}
+
+void testPoolChunked() {
+  std::cerr << "Testing chunked pool storage...\n";
+  zekku::Pool<std::string, zekku::FreeList, zekku::ChunkedStorage<>> p;
+  size_t first = p.allocate("first element");
+  const std::string* ref = &p.get(first);
+  for (size_t i = 0; i < hc; ++i) p.allocate(std::to_string(i));
+  bool ok = &p.get(first) == ref && *ref == "first element";
+  for (size_t i = 0; i < hc; ++i) {
+    if (p.get(i + 1) != std::to_string(i)) ok = false;
+  }
+  if (ok) std::cerr << "Elements stayed put while growing :)\n";
+  else std::cerr << "Chunked pool moved or lost elements!\n";
+}
+
+void testPoolCompact() {
+  std::cerr << "Testing pool compaction...\n";
+  zekku::Pool<std::string> p;
+  std::vector<size_t> handles;
+  for (size_t i = 0; i < hc; ++i) handles.push_back(p.allocate(std::to_string(i)));
+  // Free all but every 16th element
+  for (size_t i = 0; i < hc; ++i) {
+    if (i % 16 != 0) p.deallocate(handles[i]);
+  }
+  size_t oldCapacity = p.getCapacity();
+  std::vector<size_t> remap = p.compact(true);
+  bool ok = p.getCapacity() < oldCapacity;
+  for (size_t i = 0; i < hc; i += 16) {
+    size_t h = remap[handles[i]];
+    if (h >= p.size() || p.get(h) != std::to_string(i)) ok = false;
+  }
+  size_t count = 0;
+  for (auto it = p.begin(); it != p.end(); ++it) {
+    if (it.i != count) ok = false;
+    ++count;
+  }
+  if (ok && count == p.size()) {
+    fprintf(stderr, "Packed %zu elements; capacity %zu -> %zu :)\n",
+      p.size(), oldCapacity, p.getCapacity());
+  } else {
+    std::cerr << "Compaction lost or misplaced elements!\n";
+  }
+}
+
+void testPoolShrink() {
+  std::cerr << "Testing pool shrinking...\n";
+  constexpr size_t wave = 100000;
+  constexpr size_t survivors = 1000;
+  zekku::Pool<size_t, zekku::FreeList> p;
+  p.setAutoShrink(8);
+  std::vector<size_t> handles(wave);
+  p.allocateN(wave, handles.data());
+  size_t peak = p.getCapacity();
+  // The boss wave dies, apart from the oldest few bullets
+  for (size_t i = wave; i > survivors; --i) p.deallocate(handles[i - 1]);
+  size_t afterWave = p.getCapacity();
+  bool ok = afterWave < peak && afterWave >= 2 * survivors;
+  for (size_t i = 0; i < survivors; ++i) {
+    if (!p.isValid(handles[i])) ok = false;
+  }
+  // A random-probe pool can only be trimmed down to its highest handle
+  zekku::Pool<size_t> r;
+  std::vector<size_t> rh(wave);
+  for (size_t i = 0; i < wave; ++i) rh[i] = r.allocate(i);
+  size_t keep = 0;
+  for (size_t i = 0; i < wave; ++i) {
+    if (rh[i] < 200 && keep < 10) ++keep;
+    else r.deallocate(rh[i]);
+  }
+  size_t before = r.getCapacity();
+  r.shrinkToFit();
+  for (size_t i = 0; i < wave; ++i) {
+    if (r.isValid(rh[i]) && r.get(rh[i]) != i) ok = false;
+  }
+  ok = ok && r.size() == keep && r.getCapacity() < before;
+  // An arena-backed pool shrinks its block in the arena
+  zekku::Arena arena;
+  zekku::Pool<size_t, zekku::FreeList, zekku::FlatStorage,
+    zekku::ArenaAllocator> a(zekku::START_CAPAT, zekku::ArenaAllocator(arena));
+  for (size_t i = 0; i < wave; ++i) handles[i] = a.allocate(i);
+  for (size_t i = wave; i > survivors; --i) a.deallocate(handles[i - 1]);
+  a.shrinkToFit();
+  for (size_t i = 0; i < survivors; ++i) {
+    if (!a.isValid(handles[i]) || a.get(handles[i]) != i) ok = false;
+  }
+  ok = ok && a.getCapacity() < 2 * survivors;
+  if (ok) {
+    fprintf(stderr,
+      "Capacity went %zu -> %zu (auto) and %zu -> %zu (manual) :)\n",
+      peak, afterWave, before, r.getCapacity());
+  } else {
+    std::cerr << "Shrinking went wrong!\n";
+  }
+}
+
+template<typename Alloc>
+bool checkPoolWithAllocator(const Alloc& a, bool expectStable) {
+  zekku::Pool<size_t, zekku::FreeList, zekku::FlatStorage, Alloc> p(
+    zekku::START_CAPAT, a);
+  size_t first = p.allocate((size_t) 0);
+  const size_t* ref = &p.get(first);
+  for (size_t i = 1; i < hc; ++i) p.allocate(35 * i);
+  bool ok = !expectStable || &p.get(first) == ref;
+  for (size_t i = 0; i < hc; ++i) {
+    if (p.get(i) != 35 * i) ok = false;
+  }
+  return ok;
+}
+
+void testPoolAllocators() {
+  std::cerr << "Testing pool allocators...\n";
+  zekku::Arena arena;
+  bool ok = checkPoolWithAllocator(zekku::ArenaAllocator(arena), false);
+  arena.clear();
+  // Shrinking the latest allocation gives the rest back to the arena
+  char* big = (char*) arena.allocate(1000);
+  ok = ok && arena.reallocate(big, 1000, 100) == big &&
+    (char*) arena.allocate(100) < big + 1000;
+  arena.clear();
+#ifdef ZK_HAS_MMAN
+  ok = ok && checkPoolWithAllocator(zekku::HugePageAllocator(), false);
+  // Growing a pool in a reserved range must not move it
+  ok = ok && checkPoolWithAllocator(zekku::ReservedAllocator(), true);
+#endif
+  if (ok) std::cerr << "All allocators kept their elements :)\n";
+  else std::cerr << "An allocator lost or moved elements!\n";
+}
+
+struct Bullet {
+  float x, y, vx, vy;
+  uint32_t colour;
+};
+
+template<typename Policy>
+void benchPoolBulk(const char* name) {
+  constexpr size_t patternSize = 500;
+  constexpr size_t frames = 2000;
+  size_t handles[patternSize];
+  using namespace std::chrono;
+  zekku::Pool<Bullet, Policy> p1;
+  auto ms = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  for (size_t f = 0; f < frames; ++f) {
+    for (size_t i = 0; i < patternSize; ++i) handles[i] = p1.allocate();
+    for (size_t i = 0; i < patternSize; ++i) p1.deallocate(handles[i]);
+  }
+  auto ms2 = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  size_t single = (ms2 - ms).count();
+  zekku::Pool<Bullet, Policy> p2;
+  ms = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  for (size_t f = 0; f < frames; ++f) {
+    p2.allocateN(patternSize, handles);
+    p2.deallocateN(handles, patternSize);
+  }
+  ms2 = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  fprintf(stderr,
+    "%s: %zu %zu-element patterns: one at a time %zu ms, bulk %zu ms\n",
+    name, frames, patternSize, single, (size_t) (ms2 - ms).count());
+}
+
+void testPoolBulk() {
+  std::cerr << "Testing bulk pool allocation...\n";
+  zekku::Pool<size_t> p;
+  std::vector<size_t> handles(hc);
+  std::vector<size_t> more(hc / 2);
+  p.allocateN(hc, handles.data(), (size_t) 7);
+  p.deallocateN(handles.data(), hc / 2);
+  p.allocateN(hc / 2, more.data(), (size_t) 9);
+  std::set<size_t> distinct(handles.begin() + hc / 2, handles.end());
+  distinct.insert(more.begin(), more.end());
+  bool ok = distinct.size() == hc && p.size() == hc;
+  for (size_t i = hc / 2; i < hc; ++i) {
+    if (p.get(handles[i]) != 7) ok = false;
+  }
+  for (size_t h : more) {
+    if (p.get(h) != 9) ok = false;
+  }
+  // A run that spans several occupancy words comes back in the same order
+  zekku::Pool<size_t, zekku::FreeList> fl;
+  std::vector<size_t> run(200);
+  fl.allocateN(run.size(), run.data(), (size_t) 1);
+  fl.deallocateN(run.data() + 30, 140);
+  std::vector<size_t> again(140);
+  fl.allocateN(again.size(), again.data(), (size_t) 2);
+  if (fl.size() != 200 ||
+      !std::equal(again.begin(), again.end(), run.begin() + 30))
+    ok = false;
+  if (fl.get(run[29]) != 1 || fl.get(run[30]) != 2 ||
+      fl.get(run[169]) != 2 || fl.get(run[170]) != 1)
+    ok = false;
+  if (ok) std::cerr << "Bulk handles are distinct and initialised :)\n";
+  else std::cerr << "Bulk allocation returned bad handles!\n";
+  benchPoolBulk<zekku::RandomProbe>("random probe");
+  benchPoolBulk<zekku::FreeList>("free list");
+}
+
+template<typename P>
+bool checkPoolSnapshot() {
+  P p;
+  std::vector<size_t> handles;
+  for (size_t i = 0; i < 1000; ++i) handles.push_back(p.allocate(i));
+  for (size_t i = 0; i < 1000; i += 3) p.deallocate(handles[i]);
+  std::vector<char> state(p.snapshotSize());
+  if (p.snapshot(state.data()) != state.size()) return false;
+  // Play on for a bit, remembering which handles came out
+  std::vector<size_t> future;
+  for (size_t i = 0; i < 5000; ++i) future.push_back(p.allocate(i));
+  for (size_t i = 1; i < 1000; i += 3) p.deallocate(handles[i]);
+  // Roll back and replay: everything should come out the same
+  if (!p.restore(state.data(), state.size())) return false;
+  if (p.size() != 1000 - 334) return false;
+  for (size_t i = 0; i < 1000; ++i) {
+    bool live = i % 3 != 0;
+    if (p.isValid(handles[i]) != live) return false;
+    if (live && p.get(handles[i]) != i) return false;
+  }
+  for (size_t i = 0; i < 5000; ++i) {
+    if (p.allocate(i) != future[i]) return false;
+  }
+  // A short or mismatched buffer is refused, and leaves the pool alone
+  size_t before = p.size();
+  if (p.restore(state.data(), state.size() - 1)) return false;
+  // Claim less policy state than was written (policyBytes is the last
+  // field of the header)
+  std::vector<char> cut = state;
+  uint64_t policyBytes;
+  char* field = cut.data() + 3 * sizeof(uint64_t);
+  memcpy(&policyBytes, field, sizeof(policyBytes));
+  policyBytes -= sizeof(size_t);
+  memcpy(field, &policyBytes, sizeof(policyBytes));
+  if (p.restore(cut.data(), cut.size() - sizeof(size_t))) return false;
+  return p.size() == before;
+}
+
+// A full FreeList pool saves no policy state, which is too little for
+// RandomProbe
+bool checkPoolSnapshotMismatch() {
+  zekku::Pool<size_t, zekku::FreeList> full;
+  while (full.size() < full.getCapacity()) full.allocate(full.size());
+  std::vector<char> state(full.snapshotSize());
+  full.snapshot(state.data());
+  zekku::Pool<size_t> p;
+  p.allocate((size_t) 5);
+  return !p.restore(state.data(), state.size()) && p.size() == 1;
+}
+
+void testPoolSnapshot() {
+  std::cerr << "Testing pool snapshots...\n";
+  bool ok = checkPoolSnapshot<zekku::Pool<size_t>>() &&
+    checkPoolSnapshot<zekku::Pool<size_t, zekku::FreeList>>() &&
+    checkPoolSnapshot<zekku::Pool<size_t, zekku::RandomProbe,
+      zekku::ChunkedStorage<>>>() &&
+    checkPoolSnapshotMismatch();
+  if (!ok) {
+    std::cerr << "Restoring a snapshot went wrong!\n";
+    return;
+  }
+  // Time a frame's worth of save states
+  zekku::Pool<Bullet> p;
+  for (size_t i = 0; i < 100000; ++i) p.allocate();
+  std::vector<char> state(p.snapshotSize());
+  using namespace std::chrono;
+  auto ms = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  for (size_t i = 0; i < 100; ++i) {
+    p.snapshot(state.data());
+    p.restore(state.data(), state.size());
+  }
+  auto ms2 = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  fprintf(stderr,
+    "Snapshots restore identical handles :) "
+    "100 round trips of %zu bytes: %ld ms\n",
+    state.size(), (long) (ms2 - ms).count());
+}
+
+struct Entity {
+  glm::vec2 position;
+  glm::vec2 velocity;
+  float health;
+  uint32_t sprite, flags, script;
+  float scratch[24]; // everything an update loop doesn't look at
+};
+
+void testSoAPool() {
+  std::cerr << "Testing structure-of-arrays pool...\n";
+  constexpr size_t n = 1 << 16;
+  constexpr size_t frames = 1000;
+  zekku::BasicSoAPool<zekku::FreeList,
+    glm::vec2, glm::vec2, float> soa;
+  zekku::Pool<Entity, zekku::FreeList> aos;
+  for (size_t i = 0; i < n; ++i) {
+    glm::vec2 v{(float) (i % 7), (float) (i % 5)};
+    soa.allocate(glm::vec2{0.0f, 0.0f}, v, 100.0f);
+    aos.allocate();
+    aos.get(i).position = {0.0f, 0.0f};
+    aos.get(i).velocity = v;
+  }
+  // Kill every third one to break up the runs
+  for (size_t i = 0; i < n; i += 3) {
+    soa.deallocate(i);
+    aos.deallocate(i);
+  }
+  using namespace std::chrono;
+  auto ms = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  for (size_t f = 0; f < frames; ++f) {
+    glm::vec2* ZK_RESTRICT pos = soa.column<0>();
+    const glm::vec2* ZK_RESTRICT vel = soa.column<1>();
+    soa.forEachRun([pos, vel](size_t start, size_t length) {
+      for (size_t i = start; i < start + length; ++i) pos[i] += vel[i];
+    });
+  }
+  auto ms2 = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  size_t soaTime = (ms2 - ms).count();
+  ms = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  for (size_t f = 0; f < frames; ++f) {
+    for (Entity& e : aos) e.position += e.velocity;
+  }
+  ms2 = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  size_t aosTime = (ms2 - ms).count();
+  bool ok = soa.size() == aos.size();
+  size_t count = 0;
+  soa.forEach([&](size_t h) {
+    ++count;
+    const glm::vec2& p = soa.get<0>(h);
+    const glm::vec2& q = aos.get(h).position;
+    if (p.x != q.x || p.y != q.y || soa.get<2>(h) != 100.0f) ok = false;
+  });
+  // Capacities that aren't powers of two are rounded up, as in Pool
+  zekku::SoAPool<float, int> odd(100);
+  for (int i = 0; i < 100; ++i) odd.allocate((float) i, i);
+  ok = ok && odd.size() == 100 && odd.getCapacity() >= 128;
+  if (ok && count == soa.size()) {
+    fprintf(stderr,
+      "Columns agree :) %zu updates: columns %zu ms, whole entities %zu ms\n",
+      frames, soaTime, aosTime);
+  } else {
+    std::cerr << "Structure-of-arrays pool lost track of its elements!\n";
+  }
+}
+
+// Each thread keeps a window of live handles, repeatedly freeing the
+// oldest one and allocating a new one.
+template<typename A, typename D>
+size_t benchThreads(size_t nThreads, A alloc, D dealloc) {
+  constexpr size_t churns = 1 << 20;
+  constexpr size_t window = 256;
+  using namespace std::chrono;
+  auto ms = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < nThreads; ++t) {
+    threads.emplace_back([=]() {
+      size_t live[window];
+      for (size_t i = 0; i < window; ++i) live[i] = alloc(t, i);
+      for (size_t i = 0; i < churns / nThreads; ++i) {
+        size_t& h = live[i % window];
+        dealloc(t, h);
+        h = alloc(t, i);
+      }
+      for (size_t i = 0; i < window; ++i) dealloc(t, live[i]);
+    });
+  }
+  for (std::thread& th : threads) th.join();
+  auto ms2 = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  return (ms2 - ms).count();
+}
+
+void testConcurrentPool() {
+  std::cerr << "Testing concurrent pool...\n";
+  using CP = zekku::ConcurrentPool<size_t>;
+  constexpr size_t nThreads = 4;
+  constexpr size_t perThread = hc;
+  CP p;
+  std::vector<size_t> handles[nThreads];
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < nThreads; ++t) {
+    threads.emplace_back([&p, &handles, t]() {
+      CP::Cache c(p);
+      for (size_t i = 0; i < perThread; ++i)
+        handles[t].push_back(p.allocate(c, t * perThread + i));
+      // Free every other element to exercise the shared free list
+      for (size_t i = 0; i < perThread; i += 2)
+        p.deallocate(c, handles[t][i]);
+    });
+  }
+  for (std::thread& th : threads) th.join();
+  bool ok = p.size() == nThreads * perThread / 2;
+  for (size_t t = 0; t < nThreads; ++t) {
+    for (size_t i = 1; i < perThread; i += 2) {
+      if (p.get(handles[t][i]) != t * perThread + i) ok = false;
+    }
+  }
+  if (ok) std::cerr << "No handles were lost or shared :)\n";
+  else std::cerr << "Concurrent pool mixed up elements!\n";
+  std::cerr << "Benchmarking concurrent allocation...\n";
+  size_t maxThreads = std::max<size_t>(4, std::thread::hardware_concurrency());
+  for (size_t n = 1; n <= maxThreads; n <<= 1) {
+    CP cp;
+    std::vector<std::unique_ptr<CP::Cache>> caches;
+    for (size_t t = 0; t < n; ++t) caches.emplace_back(new CP::Cache(cp));
+    size_t concurrent = benchThreads(n,
+      [&](size_t t, size_t i) { return cp.allocate(*caches[t], i); },
+      [&](size_t t, size_t h) { cp.deallocate(*caches[t], h); });
+    zekku::Pool<size_t, zekku::FreeList> lp;
+    std::mutex m;
+    size_t locked = benchThreads(n,
+      [&](size_t, size_t i) {
+        std::lock_guard<std::mutex> lock(m);
+        return lp.allocate(i);
+      },
+      [&](size_t, size_t h) {
+        std::lock_guard<std::mutex> lock(m);
+        lp.deallocate(h);
+      });
+    fprintf(stderr,
+      "%zu threads: concurrent pool %zu ms, locked pool %zu ms\n",
+      n, concurrent, locked);
+  }
 }
 
 template<typename F = float>
@@ -144,6 +699,557 @@ void testQTree() {
     ints, iters, elapsed.count());
 }
 
+struct Mover {
+  float x, y;
+  size_t id;
+};
+
+void testQTreeRemove() {
+  std::cerr << "Testing quadtree removal and updates...\n";
+  using Tree = zekku::QuadTree<Mover>;
+  using H = zekku::Handle<uint16_t>;
+  Tree tree({{0.0f, 0.0f}, {100.0f, 100.0f}});
+  std::mt19937_64 r(42);
+  std::uniform_real_distribution<float> rd(-100.0f, 100.0f);
+  std::uniform_real_distribution<float> step(-1.0f, 1.0f);
+  constexpr size_t n = 20000;
+  std::vector<Mover> movers(n);
+  std::vector<H> handles(n);
+  std::vector<bool> alive(n, true);
+  auto onMove = [&](const H& /*from*/, const H& to) {
+    handles[tree.deref(to).id] = to;
+  };
+  for (size_t i = 0; i < n; ++i) {
+    // Every tenth one sits on the same spot, to build overflow chains
+    movers[i] = i % 10 == 0 ?
+      Mover{12.5f, -3.0f, i} : Mover{rd(r), rd(r), i};
+    handles[i] = tree.insert(movers[i], onMove);
+  }
+  bool ok = true;
+  for (size_t frame = 0; frame < 10; ++frame) {
+    for (size_t i = 0; i < n; ++i) {
+      if (!alive[i]) continue;
+      if (r() % 8 == 0) {
+        tree.remove(handles[i], onMove);
+        alive[i] = false;
+        continue;
+      }
+      Mover& m = movers[i];
+      if (r() % 16 == 0) {
+        m.x = rd(r);
+        m.y = rd(r);
+      } else {
+        m.x = std::min(100.0f, std::max(-100.0f, m.x + step(r)));
+        m.y = std::min(100.0f, std::max(-100.0f, m.y + step(r)));
+      }
+      handles[i] = tree.update(handles[i], m, onMove);
+    }
+    // Every live handle should still lead to its own element
+    size_t live = 0;
+    for (size_t i = 0; i < n; ++i) {
+      if (!alive[i]) continue;
+      ++live;
+      const Mover& m = tree.deref(handles[i]);
+      if (m.id != i || m.x != movers[i].x || m.y != movers[i].y) ok = false;
+    }
+    size_t found = 0;
+    tree.query(zekku::QueryAll<float>(), [&found](const Mover&) {
+      ++found;
+    });
+    if (found != live) ok = false;
+    zekku::Circle<float> query(glm::tvec2<float>{rd(r), rd(r)}, 20.0f);
+    std::set<size_t> expected, actual;
+    for (size_t i = 0; i < n; ++i) {
+      if (alive[i] && query.contains({movers[i].x, movers[i].y}))
+        expected.insert(i);
+    }
+    tree.query(query, [&actual](const Mover& m) { actual.insert(m.id); });
+    if (expected != actual) ok = false;
+  }
+  if (!ok) {
+    std::cerr << "Removal or update went wrong!\n";
+    return;
+  }
+  // Compare moving every element with rebuilding the tree
+  Tree tree2({{0.0f, 0.0f}, {100.0f, 100.0f}});
+  std::vector<H> handles2(n);
+  auto onMove2 = [&](const H& /*from*/, const H& to) {
+    handles2[tree2.deref(to).id] = to;
+  };
+  for (size_t i = 0; i < n; ++i)
+    handles2[i] = tree2.insert(movers[i], onMove2);
+  using namespace std::chrono;
+  auto ms = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  for (size_t frame = 0; frame < 100; ++frame) {
+    for (size_t i = 0; i < n; ++i) {
+      Mover m = tree2.deref(handles2[i]);
+      m.x = std::min(100.0f, std::max(-100.0f, m.x + step(r) * 0.1f));
+      m.y = std::min(100.0f, std::max(-100.0f, m.y + step(r) * 0.1f));
+      handles2[i] = tree2.update(handles2[i], m, onMove2);
+    }
+  }
+  auto ms2 = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  for (size_t frame = 0; frame < 100; ++frame) {
+    tree2 = tree2.map([&r, &step](const Mover& m) {
+      Mover m2 = m;
+      m2.x = std::min(100.0f, std::max(-100.0f, m.x + step(r) * 0.1f));
+      m2.y = std::min(100.0f, std::max(-100.0f, m.y + step(r) * 0.1f));
+      return m2;
+    });
+  }
+  auto ms3 = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  fprintf(stderr,
+    "Handles survived removal and updates :) "
+    "100 frames of %zu moves: update %ld ms, map %ld ms\n",
+    n, (long) (ms2 - ms).count(), (long) (ms3 - ms2).count());
+}
+
+// Brute-force check of knn against every element, comparing distances
+// (ties may come out in either order)
+template<typename F, typename Tree>
+bool checkKnn(
+    const Tree& tree, const std::vector<Pair<F>>& points,
+    glm::tvec2<F> q, size_t k) {
+  using D = zekku::DoubleType<F>;
+  auto dist = [q](const Pair<F>& p) {
+    F dx = p.x - q.x, dy = p.y - q.y;
+    return zekku::longMultiply(dx, dx) + zekku::longMultiply(dy, dy);
+  };
+  std::vector<D> expected;
+  for (const Pair<F>& p : points) expected.push_back(dist(p));
+  std::sort(expected.begin(), expected.end());
+  expected.resize(std::min(k, expected.size()));
+  std::vector<zekku::Handle<uint16_t>> handles;
+  tree.knn(q, k, handles);
+  if (handles.size() != expected.size()) return false;
+  for (size_t i = 0; i < handles.size(); ++i) {
+    if (dist(tree.deref(handles[i])) != expected[i]) return false;
+  }
+  // The nearest one within a radius
+  F radius = F(10);
+  zekku::Handle<uint16_t> h;
+  bool found = tree.nearest(q, radius, h);
+  bool shouldFind = !expected.empty() &&
+    !(zekku::longMultiply(radius, radius) < expected[0]);
+  if (found != shouldFind) return false;
+  return !found || dist(tree.deref(h)) == expected[0];
+}
+
+void testQTreeKnn() {
+  std::cerr << "Testing nearest neighbours...\n";
+  std::mt19937_64 r(7);
+  std::uniform_real_distribution<float> rd(-100.0f, 100.0f);
+  zekku::QuadTree<Pair<float>> tree({{0.0f, 0.0f}, {100.0f, 100.0f}});
+  using FX = kfp::s16_16;
+  zekku::QuadTree<Pair<FX>, uint16_t, FX> ftree({{0, 0}, {100, 100}});
+  std::vector<Pair<float>> points;
+  std::vector<Pair<FX>> fpoints;
+  for (size_t i = 0; i < 20000; ++i) {
+    // Clumps of identical points make overflow chains
+    Pair<float> p = i % 50 == 0 ? Pair<float>{-40.0f, 60.0f} :
+      Pair<float>{rd(r), rd(r)};
+    points.push_back(p);
+    tree.insert(p);
+    fpoints.push_back({FX(p.x), FX(p.y)});
+    ftree.insert(fpoints.back());
+  }
+  bool ok = true;
+  for (size_t i = 0; i < 200 && ok; ++i) {
+    float x = rd(r), y = rd(r);
+    size_t k = 1 + r() % 50;
+    ok = checkKnn(tree, points, {x, y}, k) &&
+      checkKnn(ftree, fpoints, {FX(x), FX(y)}, k);
+  }
+  ok = ok && checkKnn(tree, points, {-40.0f, 60.0f}, 600);
+  if (!ok) {
+    std::cerr << "Nearest neighbours went wrong!\n";
+    return;
+  }
+  // Compare with guessing a radius and sorting what it finds
+  constexpr size_t iters = 100000;
+  constexpr size_t k = 8;
+  std::vector<zekku::Handle<uint16_t>> handles;
+  using namespace std::chrono;
+  auto ms = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  size_t total = 0;
+  for (size_t i = 0; i < iters; ++i) {
+    handles.clear();
+    tree.knn({rd(r), rd(r)}, k, handles);
+    total += handles.size();
+  }
+  auto ms2 = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  for (size_t i = 0; i < iters; ++i) {
+    float x = rd(r), y = rd(r);
+    handles.clear();
+    tree.query(zekku::Circle<float>({x, y}, 5.0f), handles);
+    std::sort(handles.begin(), handles.end(),
+      [&](const zekku::Handle<uint16_t>& a, const zekku::Handle<uint16_t>& b) {
+        const Pair<float>& pa = tree.deref(a);
+        const Pair<float>& pb = tree.deref(b);
+        return hypotf(pa.x - x, pa.y - y) < hypotf(pb.x - x, pb.y - y);
+      });
+    total += std::min(k, handles.size());
+  }
+  auto ms3 = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  fprintf(stderr,
+    "Neighbours are nearest :) %zu %zu-nn queries: knn %ld ms, "
+    "radius + sort %ld ms (%zu found)\n",
+    iters, k, (long) (ms2 - ms).count(), (long) (ms3 - ms2).count(), total);
+}
+
+void testQTreeBuild() {
+  std::cerr << "Testing quadtree bulk loading...\n";
+  using Tree = zekku::QuadTree<Pair<float>, uint32_t>;
+  std::mt19937_64 r(99);
+  std::uniform_real_distribution<float> rd(-100.0f, 100.0f);
+  constexpr size_t n = 100000;
+  std::vector<Pair<float>> points(n);
+  for (auto& p : points) p = {rd(r), rd(r)};
+  using namespace std::chrono;
+  auto ms = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  Tree inserted({{0.0f, 0.0f}, {100.0f, 100.0f}});
+  for (const auto& p : points) inserted.insert(p);
+  auto ms2 = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  Tree built({{0.0f, 0.0f}, {100.0f, 100.0f}});
+  built.build(points.begin(), points.end());
+  auto ms3 = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  // Same shape means both trees visit the elements in the same order
+  std::vector<Pair<float>> a, b;
+  inserted.query(zekku::QueryAll<float>(), [&a](const Pair<float>& p) {
+    a.push_back(p);
+  });
+  built.query(zekku::QueryAll<float>(), [&b](const Pair<float>& p) {
+    b.push_back(p);
+  });
+  bool ok = a == b;
+  // Clumps of identical points go into overflow chains
+  for (size_t i = 0; i < n; i += 20) points[i] = {30.0f, -30.0f};
+  built.build(points.begin(), points.end());
+  zekku::Circle<float> query(glm::tvec2<float>{25.0f, -25.0f}, 20.0f);
+  std::multiset<Pair<float>> expected, actual;
+  for (const auto& p : points) {
+    if (query.contains({p.x, p.y})) expected.insert(p);
+  }
+  built.query(query, [&actual](const Pair<float>& p) { actual.insert(p); });
+  ok = ok && expected == actual;
+  if (ok) {
+    fprintf(stderr,
+      "Built tree matches :) %zu points: insert %ld ms, build %ld ms\n",
+      n, (long) (ms2 - ms).count(), (long) (ms3 - ms2).count());
+  } else {
+    std::cerr << "Bulk loading went wrong!\n";
+  }
+}
+
+void testQTreeEarlyExit() {
+  std::cerr << "Testing early exit from quadtree queries...\n";
+  zekku::QuadTree<Pair<float>> tree({{0.0f, 0.0f}, {100.0f, 100.0f}});
+  std::mt19937_64 r(11);
+  std::uniform_real_distribution<float> rd(-100.0f, 100.0f);
+  for (size_t i = 0; i < opts.nObjects; ++i) {
+    // Leave the north-west corner empty
+    Pair<float> p = {rd(r), rd(r)};
+    if (p.x < -50.0f && p.y < -50.0f) continue;
+    tree.insert(p);
+  }
+  zekku::Circle<float> query(glm::tvec2<float>{10.0f, 10.0f}, 30.0f);
+  size_t seen = 0;
+  bool finished = tree.query(query, [&seen](const Pair<float>&) {
+    return ++seen == 5 ? zekku::Traversal::STOP : zekku::Traversal::CONTINUE;
+  });
+  zekku::Handle<uint16_t> h;
+  bool found = tree.queryFirst(query, h);
+  bool ok = !finished && seen == 5 && found &&
+    query.contains({tree.deref(h).x, tree.deref(h).y});
+  zekku::AABB<float> corner = {{-80.0f, -80.0f}, {10.0f, 10.0f}};
+  ok = ok && !tree.queryFirst(corner, h);
+  using namespace std::chrono;
+  auto ms = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  size_t hits = 0;
+  constexpr size_t iters = 100000;
+  for (size_t i = 0; i < iters; ++i) {
+    zekku::Circle<float> q(glm::tvec2<float>{rd(r), rd(r)}, 20.0f);
+    hits += tree.queryFirst(q, h);
+  }
+  auto ms2 = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  if (ok) {
+    fprintf(stderr,
+      "Stopped when told to :) %zu any-hit queries (%zu hits): %ld ms\n",
+      iters, hits, (long) (ms2 - ms).count());
+  } else {
+    std::cerr << "Early exit went wrong!\n";
+  }
+}
+
+void testQTreeBatch() {
+  std::cerr << "Testing batched quadtree queries...\n";
+  using H = zekku::Handle<uint16_t>;
+  zekku::QuadTree<Pair<float>> tree({{0.0f, 0.0f}, {100.0f, 100.0f}});
+  std::mt19937_64 r(29);
+  std::uniform_real_distribution<float> rd(-100.0f, 100.0f);
+  for (size_t i = 0; i < opts.nObjects; ++i) tree.insert({rd(r), rd(r)});
+  constexpr size_t nShapes = 5000;
+  std::vector<zekku::Circle<float>> shapes;
+  for (size_t i = 0; i < nShapes; ++i) {
+    // A few of them fall outside the tree altogether
+    shapes.push_back(zekku::Circle<float>(
+      glm::tvec2<float>{rd(r) * 1.1f, rd(r) * 1.1f}, 3.0f));
+  }
+  using namespace std::chrono;
+  constexpr size_t iters = 100;
+  auto ms = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  std::vector<std::vector<H>> one(nShapes);
+  for (size_t k = 0; k < iters; ++k) {
+    for (size_t i = 0; i < nShapes; ++i) {
+      one[i].clear();
+      tree.query(shapes[i], one[i]);
+    }
+  }
+  auto ms2 = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  std::vector<zekku::QueryHit<uint16_t>> hits;
+  for (size_t k = 0; k < iters; ++k) {
+    hits.clear();
+    tree.queryBatch(shapes, hits);
+  }
+  auto ms3 = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  std::vector<std::vector<H>> batched(nShapes);
+  for (const auto& hit : hits) batched[hit.query].push_back(hit.handle);
+  size_t total = 0;
+  bool ok = true;
+  for (size_t i = 0; i < nShapes; ++i) {
+    std::sort(one[i].begin(), one[i].end());
+    std::sort(batched[i].begin(), batched[i].end());
+    ok = ok && one[i] == batched[i];
+    total += one[i].size();
+  }
+  if (ok) {
+    fprintf(stderr,
+      "Batches match :) %zu x %zu queries (%zu hits each time): "
+      "one at a time %ld ms, batched %ld ms\n",
+      iters, nShapes, total,
+      (long) (ms2 - ms).count(), (long) (ms3 - ms2).count());
+  } else {
+    std::cerr << "Batched queries went wrong!\n";
+  }
+}
+
+// A big element whose position costs something to get
+struct BigEntity {
+  float x, y;
+  size_t id;
+  char payload[240];
+};
+
+struct CountingGetXY {
+  CountingGetXY(size_t* calls) : calls(calls) {}
+  size_t* calls;
+  glm::tvec2<float> operator()(const BigEntity& e) const {
+    ++*calls;
+    return {e.x, e.y};
+  }
+};
+
+void testQTreeCachedPositions() {
+  std::cerr << "Testing that queries don't call GetXY...\n";
+  using H = zekku::Handle<uint16_t>;
+  size_t calls = 0;
+  zekku::QuadTree<BigEntity, uint16_t, float,
+    zekku::QUADTREE_NODE_COUNT, CountingGetXY>
+    tree({{0.0f, 0.0f}, {100.0f, 100.0f}}, &calls);
+  std::mt19937_64 r(11);
+  std::uniform_real_distribution<float> rd(-100.0f, 100.0f);
+  constexpr size_t n = 5000;
+  std::vector<H> handles(n);
+  std::vector<bool> alive(n, true);
+  auto onMove = [&](const H& /*from*/, const H& to) {
+    handles[tree.deref(to).id] = to;
+  };
+  for (size_t i = 0; i < n; ++i) {
+    BigEntity e;
+    e.x = rd(r);
+    e.y = rd(r);
+    e.id = i;
+    handles[i] = tree.insert(e, onMove);
+  }
+  // One call per element inserted, however many times leaves split
+  bool ok = calls == n;
+  std::vector<zekku::Circle<float>> shapes;
+  for (size_t i = 0; i < 100; ++i) {
+    shapes.push_back(
+      zekku::Circle<float>(glm::tvec2<float>{rd(r), rd(r)}, 10.0f));
+    std::vector<H> out;
+    tree.query(shapes.back(), out);
+    tree.knn({rd(r), rd(r)}, 8, out);
+  }
+  std::vector<zekku::QueryHit<uint16_t>> hits;
+  tree.queryBatch(shapes, hits);
+  for (size_t i = 0; i < n; i += 3) {
+    tree.remove(handles[i], onMove);
+    alive[i] = false;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    if (!alive[i]) continue;
+    const BigEntity& e = tree.deref(handles[i]);
+    glm::tvec2<float> p = tree.positionOf(handles[i]);
+    if (e.id != i || p.x != e.x || p.y != e.y) ok = false;
+  }
+  if (ok && calls == n) {
+    std::cerr << "Only inserts called GetXY :)\n";
+  } else {
+    std::cerr << "Cached positions went wrong! (" << calls << " calls)\n";
+  }
+}
+
+void testLinearQTree() {
+  std::cerr << "Testing linear quadtree...\n";
+  using P = Pair<float>;
+  zekku::AABB<float> box = {{0.0f, 0.0f}, {100.0f, 100.0f}};
+  zekku::QuadTree<P> tree(box);
+  zekku::LinearQuadTree<P> linear(box);
+  std::mt19937_64 r(17);
+  std::uniform_real_distribution<float> rd(-100.0f, 100.0f);
+  std::vector<P> points;
+  for (size_t i = 0; i < opts.nObjects; ++i) {
+    // Some points on one spot, deeper than the keys go
+    points.push_back(i % 50 == 0 ? P{33.0f, -7.5f} : P{rd(r), rd(r)});
+  }
+  tree.build(points.begin(), points.end());
+  linear.build(points.begin(), points.end());
+  bool ok = linear.size() == points.size();
+  for (size_t i = 0; i < 1000 && ok; ++i) {
+    glm::tvec2<float> c = {rd(r), rd(r)};
+    std::multiset<P> expected, actual;
+    auto add = [](std::multiset<P>& out) {
+      return [&out](const P& p) { out.insert(p); };
+    };
+    zekku::Circle<float> circle(c, std::abs(rd(r)) * 0.3f);
+    tree.query(circle, add(expected));
+    linear.query(circle, add(actual));
+    zekku::AABB<float> rect = {c, {std::abs(rd(r)) * 0.2f, 5.0f}};
+    tree.query(rect, add(expected));
+    linear.query(rect, add(actual));
+    ok = expected == actual;
+  }
+  size_t found;
+  zekku::AABB<float> spot = {{33.0f, -7.5f}, {0.0f, 0.0f}};
+  ok = ok && linear.queryFirst(spot, found) &&
+    linear.deref(found) == P{33.0f, -7.5f};
+  // Most of the points are outside this box, so it has to grow
+  zekku::LinearQuadTree<P> small({{10.0f, 10.0f}, {5.0f, 5.0f}});
+  small.build(points.begin(), points.end());
+  std::vector<size_t> everything;
+  small.query(box, everything);
+  ok = ok && small.getBox().s.x >= 100.0f &&
+    everything.size() == points.size();
+  using namespace std::chrono;
+  size_t hits[2] = {0, 0};
+  long times[2];
+  for (size_t k = 0; k < 2; ++k) {
+    std::mt19937_64 rq(23);
+    auto ms = duration_cast<milliseconds>(
+      system_clock::now().time_since_epoch()
+    );
+    constexpr size_t iters = 100000;
+    for (size_t i = 0; i < iters; ++i) {
+      zekku::Circle<float> q(glm::tvec2<float>{rd(rq), rd(rq)}, 20.0f);
+      auto count = [&hits, k](const P&) { ++hits[k]; };
+      if (k == 0) tree.query(q, count);
+      else linear.query(q, count);
+    }
+    auto ms2 = duration_cast<milliseconds>(
+      system_clock::now().time_since_epoch()
+    );
+    times[k] = (long) (ms2 - ms).count();
+  }
+  if (ok && hits[0] == hits[1]) {
+    fprintf(stderr,
+      "Linear tree matches :) 100000 circle queries: "
+      "pointer tree %ld ms (%zu bytes), linear tree %ld ms (%zu bytes)\n",
+      times[0], tree.memoryUsage(), times[1], linear.memoryUsage());
+  } else {
+    std::cerr << "Linear tree went wrong!\n";
+  }
+}
+
+// Does LeafKernel agree with contains for every prefix of 64 points?
+template<typename Q, typename F>
+bool checkLeafKernel(const Q& shape, const F* xs, const F* ys) {
+  for (size_t count = 1; count <= 64; ++count) {
+    uint64_t m = zekku::LeafKernel<Q, F>::mask(shape, xs, ys, count);
+    if (m != zekku::scalarLeafMask(shape, xs, ys, count)) return false;
+  }
+  return true;
+}
+
+void testLeafKernels() {
+  std::cerr << "Testing leaf kernels...\n";
+  using FX = kfp::s16_16;
+  std::mt19937_64 r(5);
+  std::uniform_real_distribution<float> rd(-100.0f, 100.0f);
+  float xs[64], ys[64];
+  FX fxs[64], fys[64];
+  bool ok = true;
+  for (size_t round = 0; round < 1000 && ok; ++round) {
+    glm::tvec2<float> c = {rd(r), rd(r)};
+    float rad = std::abs(rd(r)) * 0.5f;
+    for (size_t i = 0; i < 64; ++i) {
+      xs[i] = c.x + rd(r) * 0.5f;
+      ys[i] = c.y + rd(r) * 0.5f;
+      fxs[i] = FX(xs[i]);
+      fys[i] = FX(ys[i]);
+    }
+    // Some points right on the edges
+    xs[3] = c.x + rad; ys[3] = c.y;
+    xs[9] = c.x - rad; ys[9] = c.y + rad;
+    int32_t k = (int32_t) (round % 4000) * 4;
+    FX fc = FX::raw(5 * k);
+    fxs[5] = FX::raw(3 * k); fys[5] = FX::raw(4 * k);
+    fxs[40] = FX::raw(-4 * k); fys[40] = FX::raw(3 * k);
+    fxs[41] = FX::raw(5 * k); fys[41] = FX::raw(1);
+    ok = ok &&
+      checkLeafKernel(zekku::Circle<float>(c, rad), xs, ys) &&
+      checkLeafKernel(zekku::AABB<float>{c, {rad, rad * 0.5f}}, xs, ys) &&
+      checkLeafKernel(
+        zekku::Circle<FX>({FX(c.x), FX(c.y)}, FX(rad)), fxs, fys) &&
+      checkLeafKernel(zekku::Circle<FX>({FX(0), FX(0)}, fc), fxs, fys) &&
+      checkLeafKernel(
+        zekku::AABB<FX>{{FX(0), FX(0)}, {FX::raw(3 * k), fc}}, fxs, fys);
+  }
+  if (ok) {
+    std::cerr << "Kernels agree with contains :)\n";
+  } else {
+    std::cerr << "Kernels went wrong!\n";
+  }
+}
+
 constexpr size_t NPOINT_PATHO = 50;
 void testQTreePathological() {
   std::cerr << "Testing nasty cases...\n";
@@ -233,6 +1339,16 @@ void testBBQTree() {
   } else {
     std::cerr << "Sets are equal :)\n";
   }
+  tree.compact();
+  handles.clear();
+  tree.query(query, handles);
+  actualNearPairs.clear();
+  for (const auto& h : handles) {
+    actualNearPairs.insert(tree.deref(h).box);
+  }
+  if (nearPairs != actualNearPairs) {
+    std::cerr << "Compacting the tree changed query results!\n";
+  }
   std::uniform_real_distribution<float> rd2(-100.0f, 100.0f);
   std::cerr << "Testing performance...\n";
   using namespace std::chrono;
@@ -304,6 +1420,36 @@ void testBBQTree() {
   ms = duration_cast<milliseconds>(
     system_clock::now().time_since_epoch()
   );
+  for (size_t i = 0; i < updateIters; ++i) {
+    tree.applyIncremental(callback);
+  }
+  ms2 = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
+  elapsed = ms2 - ms;
+  fprintf(stderr,
+    "Done! %zu applyIncremental() calls taking %zu ms.\n",
+    updateIters, elapsed.count());
+  // Every element should still be there once, and be found by queries
+  std::vector<zekku::BBHandle> all;
+  tree.query(zekku::QueryAll<float>(), all);
+  bool moved = all.size() == entries.size();
+  for (size_t i = 0; i < 100 && moved; ++i) {
+    zekku::Circle<float>
+      query(glm::tvec2<float>{rd2(r), rd2(r)}, opts.searchRadius);
+    std::set<uint32_t> expected, actual;
+    for (const auto& h : all) {
+      if (query.intersects(tree.deref(h).box)) expected.insert(h.index);
+    }
+    handles.clear();
+    tree.query(query, handles);
+    for (const auto& h : handles) actual.insert(h.index);
+    moved = expected == actual;
+  }
+  if (!moved) std::cerr << "Incremental apply went wrong!\n";
+  ms = duration_cast<milliseconds>(
+    system_clock::now().time_since_epoch()
+  );
   for (size_t i = 0; i < updateIters; ++i) {
     for (auto& e : entries)
       callback(e);
@@ -317,6 +1463,387 @@ void testBBQTree() {
     updateIters, elapsed.count());
 }
 
+void testBBQTreeRemove() {
+  std::cerr << "Testing bounding box quadtree removal...\n";
+  zekku::BoxQuadTree<TestEntry, uint32_t> tree({{0, 0}, {100, 100}});
+  std::mt19937_64 r(23);
+  std::uniform_real_distribution<float> rd(-1.0f, 1.0f);
+  constexpr size_t n = 20000;
+  std::vector<TestEntry> entries(n);
+  std::vector<zekku::BBHandle> handles(n);
+  std::vector<bool> alive(n, true);
+  for (size_t i = 0; i < n; ++i) {
+    TestEntry& e = entries[i];
+    if (i % 10 == 0) {
+      // Piles of identical boxes, to build link chains
+      e.box = {{20.0f, -30.0f}, {1.0f, 1.0f}};
+    } else if (i % 10 == 1) {
+      // Big ones that stay in stems
+      e.box = {{90 * rd(r), 90 * rd(r)}, {8.0f, 8.0f}};
+    } else {
+      e.box = {{95 * rd(r), 95 * rd(r)}, {0.5f, 0.5f}};
+    }
+    e.velocity = {rd(r), rd(r)};
+    handles[i] = tree.insert(e);
+  }
+  size_t live = n;
+  auto check = [&]() {
+    std::vector<zekku::BBHandle> all;
+    tree.query(zekku::QueryAll<float>(), all);
+    if (all.size() != live || tree.size() != live) return false;
+    for (size_t k = 0; k < 20; ++k) {
+      zekku::Circle<float> query(
+        glm::tvec2<float>{100 * rd(r), 100 * rd(r)}, 15.0f);
+      std::set<uint32_t> expected, actual;
+      for (size_t i = 0; i < n; ++i) {
+        if (alive[i] && query.intersects(entries[i].box))
+          expected.insert(handles[i].index);
+      }
+      std::vector<zekku::BBHandle> out;
+      tree.query(query, out);
+      for (const auto& h : out) actual.insert(h.index);
+      if (expected != actual) return false;
+    }
+    return true;
+  };
+  bool ok = true;
+  for (size_t round = 0; round < 4 && ok; ++round) {
+    for (size_t i = 0; i < n; ++i) {
+      if (!alive[i] || r() % 3 != 0) continue;
+      tree.remove(handles[i]);
+      alive[i] = false;
+      --live;
+    }
+    ok = check();
+    // Moving what's left shouldn't lose anything either
+    auto step = [](TestEntry& e) { e.box.c += e.velocity; };
+    tree.applyIncremental(step);
+    for (size_t i = 0; i < n; ++i) {
+      if (alive[i]) step(entries[i]);
+    }
+    ok = ok && check();
+  }
+  for (size_t i = 0; i < n; ++i) {
+    if (!alive[i]) continue;
+    tree.remove(handles[i]);
+    alive[i] = false;
+    --live;
+  }
+  ok = ok && check();
+  if (ok) {
+    std::cerr << "Removed elements are gone :)\n";
+  } else {
+    std::cerr << "Removal from bounding box quadtree went wrong!\n";
+  }
+}
+
+struct PairBox {
+  zekku::AABB<float> box;
+  uint32_t id;
+};
+
+void testBBQTreePairs() {
+  std::cerr << "Testing overlapping pairs in bounding box quadtrees...\n";
+  using namespace std::chrono;
+  using Tree = zekku::BoxQuadTree<PairBox, uint32_t>;
+  using IdPair = std::pair<uint32_t, uint32_t>;
+  std::mt19937_64 r(41);
+  std::uniform_real_distribution<float> rd(-1.0f, 1.0f);
+  auto byTraversal = [](const Tree& tree) {
+    std::vector<IdPair> pairs;
+    tree.forEachOverlappingPair(
+      [&pairs](const PairBox& a, const PairBox& b) {
+        pairs.push_back({std::min(a.id, b.id), std::max(a.id, b.id)});
+      });
+    std::sort(pairs.begin(), pairs.end());
+    return pairs;
+  };
+  // The old way: one query per element, keeping the pairs found from the
+  // element with the lower id
+  auto byQueries = [](const Tree& tree) {
+    std::vector<zekku::BBHandle> all, out;
+    tree.query(zekku::QueryAll<float>(), all);
+    std::vector<IdPair> pairs;
+    for (const auto& h : all) {
+      const PairBox& a = tree.deref(h);
+      out.clear();
+      tree.query(a.box, out);
+      for (const auto& o : out) {
+        uint32_t id = tree.deref(o).id;
+        if (id > a.id) pairs.push_back({a.id, id});
+      }
+    }
+    std::sort(pairs.begin(), pairs.end());
+    return pairs;
+  };
+  auto add = [](Tree& tree, float x, float y, float w, float h) {
+    uint32_t id = (uint32_t) tree.size();
+    tree.insert(PairBox{{{x, y}, {w, h}}, id});
+  };
+  bool ok = true;
+  for (size_t n : {10000, 100000}) {
+    float extent = 100.0f * std::sqrt(n / 10000.0f);
+    Tree tree({{0, 0}, {extent, extent}});
+    // Unit tiles along the split lines through the centre and along the
+    // east edge, which touch each other exactly
+    for (int k = -8; k < 8; ++k) {
+      add(tree, k + 0.5f, 0.5f, 0.5f, 0.5f);
+      add(tree, k + 0.5f, -0.5f, 0.5f, 0.5f);
+      add(tree, 0.5f, k + 0.5f, 0.5f, 0.5f);
+      add(tree, extent - 0.5f, k + 0.5f, 0.5f, 0.5f);
+    }
+    while (tree.size() < n) {
+      float size = tree.size() % 50 == 0 ? 5.5f : 0.7f;
+      add(tree, extent * rd(r), extent * rd(r),
+        size + 0.5f * size * rd(r), size + 0.5f * size * rd(r));
+    }
+    auto ms = duration_cast<milliseconds>(
+      system_clock::now().time_since_epoch());
+    std::vector<IdPair> pairs = byTraversal(tree);
+    auto ms2 = duration_cast<milliseconds>(
+      system_clock::now().time_since_epoch());
+    std::vector<IdPair> expected = byQueries(tree);
+    auto ms3 = duration_cast<milliseconds>(
+      system_clock::now().time_since_epoch());
+    fprintf(stderr,
+      "Done! %zu overlapping pairs of %zu boxes taking %zu ms "
+      "(%zu ms with one query per box).\n",
+      pairs.size(), n, (size_t) (ms2 - ms).count(),
+      (size_t) (ms3 - ms2).count());
+    // Sorted, so a pair reported twice would be next to itself
+    ok = ok && pairs == expected &&
+      std::adjacent_find(pairs.begin(), pairs.end()) == pairs.end();
+    if (n != 10000) continue;
+    // Check the queries themselves by brute force on the small one
+    std::vector<zekku::BBHandle> all;
+    tree.query(zekku::QueryAll<float>(), all);
+    std::vector<IdPair> brute;
+    for (size_t i = 0; i < all.size(); ++i) {
+      const PairBox& a = tree.deref(all[i]);
+      for (size_t j = i + 1; j < all.size(); ++j) {
+        const PairBox& b = tree.deref(all[j]);
+        if (a.box.intersects(b.box))
+          brute.push_back({std::min(a.id, b.id), std::max(a.id, b.id)});
+      }
+    }
+    std::sort(brute.begin(), brute.end());
+    ok = ok && brute == expected;
+    // Moving things around (and out of the box) shouldn't lose any pairs
+    // either, even when two boxes slide up to a split line from both sides
+    uint32_t left = (uint32_t) tree.size();
+    add(tree, -3.0f, 3.3f, 0.5f, 0.5f);
+    add(tree, 3.0f, 3.3f, 0.5f, 0.5f);
+    for (int k = -8; k < 8; ++k)
+      add(tree, extent + 0.5f, k + 0.5f, 0.5f, 0.5f);
+    tree.applyIncremental([&](PairBox& b) {
+      if (b.id == left || b.id == left + 1)
+        b.box.c.x = b.id == left ? -0.5f : 0.5f;
+      else if (b.id % 2 == 0)
+        b.box.c += glm::vec2(rd(r), rd(r));
+    });
+    ok = ok && byTraversal(tree) == byQueries(tree);
+  }
+  if (ok) {
+    std::cerr << "Each overlapping pair was found once :)\n";
+  } else {
+    std::cerr << "Finding overlapping pairs went wrong!\n";
+  }
+}
+
+// Something else to join PairBoxes with, kept in a tree with its own GetBB
+struct Target {
+  uint32_t id;
+  zekku::AABB<float> hitbox;
+};
+
+struct TargetGetBB {
+  const zekku::AABB<float>& operator()(const Target& t) const {
+    return t.hitbox;
+  }
+};
+
+void testBBQTreeJoin() {
+  std::cerr << "Testing joins of bounding box quadtrees...\n";
+  using namespace std::chrono;
+  using Targets = zekku::BoxQuadTree<
+    Target, uint32_t, float, zekku::QUADTREE_NODE_COUNT,
+    zekku::AABB<float>, TargetGetBB>;
+  using IdPair = std::pair<uint32_t, uint32_t>;
+  std::mt19937_64 r(43);
+  std::uniform_real_distribution<float> rd(-1.0f, 1.0f);
+  bool ok = true;
+  for (size_t n : {2000, 20000}) {
+    zekku::BoxQuadTree<PairBox, uint32_t> bullets({{0, 0}, {100, 100}});
+    Targets targets({{30, -20}, {64, 64}});
+    std::vector<PairBox> bs;
+    std::vector<Target> ts;
+    for (uint32_t i = 0; i < n; ++i) {
+      PairBox b = {{{100 * rd(r), 100 * rd(r)}, {0.3f, 0.3f}}, i};
+      // Some big bullets; the targets spill out of their first box
+      if (i % 100 == 0) b.box.s = {6.0f, 6.0f};
+      Target t = {i, {{100 * rd(r), 100 * rd(r)},
+        {1.0f + 0.5f * rd(r), 1.0f + 0.5f * rd(r)}}};
+      bs.push_back(b);
+      ts.push_back(t);
+      bullets.insert(b);
+      targets.insert(t);
+    }
+    auto ms = duration_cast<milliseconds>(
+      system_clock::now().time_since_epoch());
+    std::vector<IdPair> joined;
+    zekku::join(bullets, targets,
+      [&joined](const PairBox& b, const Target& t) {
+        joined.push_back({b.id, t.id});
+      });
+    auto ms2 = duration_cast<milliseconds>(
+      system_clock::now().time_since_epoch());
+    std::vector<IdPair> queried;
+    std::vector<zekku::BBHandle> out;
+    for (const PairBox& b : bs) {
+      out.clear();
+      targets.query(b.box, out);
+      for (const auto& h : out) queried.push_back({b.id, targets.deref(h).id});
+    }
+    auto ms3 = duration_cast<milliseconds>(
+      system_clock::now().time_since_epoch());
+    fprintf(stderr,
+      "Done! %zu hits between %zu bullets and %zu targets taking %zu ms "
+      "(%zu ms with one query per bullet).\n",
+      joined.size(), n, n, (size_t) (ms2 - ms).count(),
+      (size_t) (ms3 - ms2).count());
+    std::sort(joined.begin(), joined.end());
+    std::sort(queried.begin(), queried.end());
+    ok = ok && joined == queried;
+    if (n != 2000) continue;
+    std::vector<IdPair> brute;
+    for (const PairBox& b : bs) {
+      for (const Target& t : ts) {
+        if (b.box.intersects(t.hitbox)) brute.push_back({b.id, t.id});
+      }
+    }
+    std::sort(brute.begin(), brute.end());
+    ok = ok && brute == joined;
+  }
+  if (ok) {
+    std::cerr << "Joins match :)\n";
+  } else {
+    std::cerr << "Joining trees went wrong!\n";
+  }
+}
+
+void testBBQTreeLoose() {
+  std::cerr << "Testing loose bounding box quadtrees...\n";
+  using namespace std::chrono;
+  using Tree = zekku::BoxQuadTree<PairBox, uint32_t>;
+  using IdPair = std::pair<uint32_t, uint32_t>;
+  std::mt19937_64 r(47);
+  std::uniform_real_distribution<float> rd(-1.0f, 1.0f);
+  Tree tight({{0, 0}, {100, 100}});
+  Tree loose({{0, 0}, {100, 100}});
+  loose.setLooseness(2.0f);
+  constexpr size_t n = 50000;
+  for (uint32_t i = 0; i < n; ++i) {
+    PairBox b = {{{100 * rd(r), 100 * rd(r)},
+      {0.6f + 0.4f * rd(r), 0.6f + 0.4f * rd(r)}}, i};
+    // Lots of boxes on the lines between quadrants, which a tight tree
+    // has to keep near the top
+    if (i % 4 == 0) b.box.c.x = 25.0f * (float) (r() % 8) - 87.5f;
+    if (i % 4 == 1) b.box.c.y = 25.0f * (float) (r() % 8) - 87.5f;
+    tight.insert(b);
+    loose.insert(b);
+  }
+  // Queries against every element in the tree
+  auto matches = [&r, &rd](const Tree& tree) {
+    std::vector<zekku::BBHandle> all, out;
+    tree.query(zekku::QueryAll<float>(), all);
+    for (size_t k = 0; k < 20; ++k) {
+      zekku::AABB<float> query = {{100 * rd(r), 100 * rd(r)}, {5, 5}};
+      std::set<uint32_t> expected, actual;
+      for (const auto& h : all) {
+        if (query.intersects(tree.deref(h).box)) expected.insert(h.index);
+      }
+      out.clear();
+      tree.query(query, out);
+      for (const auto& h : out) actual.insert(h.index);
+      if (expected != actual) return false;
+    }
+    return true;
+  };
+  auto pairsOf = [](const Tree& tree) {
+    std::vector<IdPair> pairs;
+    tree.forEachOverlappingPair(
+      [&pairs](const PairBox& a, const PairBox& b) {
+        pairs.push_back({std::min(a.id, b.id), std::max(a.id, b.id)});
+      });
+    std::sort(pairs.begin(), pairs.end());
+    return pairs;
+  };
+  // Every element meets itself, and the rest once each way round
+  auto joinedPairs = [](const Tree& a, const Tree& b) {
+    std::vector<IdPair> pairs;
+    zekku::join(a, b, [&pairs](const PairBox& x, const PairBox& y) {
+      if (x.id < y.id) pairs.push_back({x.id, y.id});
+    });
+    std::sort(pairs.begin(), pairs.end());
+    return pairs;
+  };
+  std::vector<zekku::AABB<float>> queries(100000);
+  for (auto& q : queries) q = {{100 * rd(r), 100 * rd(r)}, {1, 1}};
+  size_t times[2], hits[2] = {0, 0};
+  for (int which = 0; which < 2; ++which) {
+    const Tree& tree = which == 0 ? tight : loose;
+    std::vector<zekku::BBHandle> out;
+    auto ms = duration_cast<milliseconds>(
+      system_clock::now().time_since_epoch());
+    for (const auto& q : queries) {
+      out.clear();
+      tree.query(q, out);
+      hits[which] += out.size();
+    }
+    auto ms2 = duration_cast<milliseconds>(
+      system_clock::now().time_since_epoch());
+    times[which] = (size_t) (ms2 - ms).count();
+  }
+  std::vector<IdPair> expected = pairsOf(tight);
+  bool ok = hits[0] == hits[1] && matches(loose) &&
+    pairsOf(loose) == expected && joinedPairs(loose, tight) == expected;
+  // Moving, removing and loosening further shouldn't lose anything
+  auto step = [](PairBox& b) {
+    if (b.id % 3 == 0)
+      b.box.c += glm::vec2(b.id % 5 - 2.0f, b.id % 7 - 3.0f);
+  };
+  tight.applyIncremental(step);
+  loose.applyIncremental(step);
+  ok = ok && matches(loose) && pairsOf(loose) == pairsOf(tight);
+  std::vector<zekku::BBHandle> all;
+  loose.query(zekku::QueryAll<float>(), all);
+  for (const auto& h : all) {
+    if (loose.deref(h).id % 2 == 0) loose.remove(h);
+  }
+  loose.setLooseness(1.5f);
+  ok = ok && loose.size() == n / 2 && matches(loose) &&
+    joinedPairs(loose, loose) == pairsOf(loose);
+  // Shrinking must not leave elements sticking out of the box
+  Tree sparse({{0, 0}, {1000, 1000}});
+  sparse.setLooseness(2.0f);
+  for (uint32_t i = 0; i < 500; ++i)
+    sparse.insert(PairBox{{{15 + 5 * rd(r), 15 + 5 * rd(r)}, {1, 1}}, i});
+  ok = ok && sparse.shrinkToFit() && sparse.getBox().s.x < 1000;
+  all.clear();
+  sparse.query(zekku::AABB<float>{{15, 15}, {7, 7}}, all);
+  ok = ok && all.size() == 500;
+  for (const auto& h : all) {
+    if (!sparse.deref(h).box.isWithin(sparse.getBox())) ok = false;
+  }
+  if (ok) {
+    fprintf(stderr,
+      "Loose tree matches :) %zu box queries: tight %zu ms, loose %zu ms\n",
+      queries.size(), times[0], times[1]);
+  } else {
+    std::cerr << "Loose quadtree went wrong!\n";
+  }
+}
+
 void testBBQTreeFixed() {
   using F = kfp::s16_16;
   std::cerr << "Testing bounding box quadtree (with fixed point)...\n";
@@ -464,6 +1991,198 @@ void testBBQTreeFixed() {
     updateIters, elapsed.count());
 }
 
+// Checks that every live handle leads to its own element, and that a
+// circle query finds the same elements as brute force.
+template<typename Tree>
+bool checkMovers(
+    Tree& tree, const std::vector<Mover>& movers,
+    const std::vector<zekku::Handle<uint16_t>>& handles,
+    const std::vector<bool>& alive, zekku::Circle<float> query) {
+  std::set<size_t> expected, actual;
+  for (size_t i = 0; i < movers.size(); ++i) {
+    if (!alive[i]) continue;
+    const Mover& m = tree.deref(handles[i]);
+    if (m.id != i || m.x != movers[i].x || m.y != movers[i].y) return false;
+    if (query.contains({m.x, m.y})) expected.insert(i);
+  }
+  tree.query(query, [&actual](const Mover& m) { actual.insert(m.id); });
+  return expected == actual;
+}
+
+void testTreeGrowth() {
+  std::cerr << "Testing growing and shrinking tree boxes...\n";
+  using H = zekku::Handle<uint16_t>;
+  std::mt19937_64 r(7);
+  std::uniform_real_distribution<float> rd(-1.0f, 1.0f);
+  bool ok = true;
+  // Once from a box that doubles exactly, and once from one that doesn't
+  for (float c : {0.0f, 0.1f}) {
+    zekku::QuadTree<Mover> tree({{c, c}, {1.0f, 1.0f}});
+    std::vector<Mover> movers;
+    std::vector<H> handles;
+    std::vector<bool> alive;
+    auto onMove = [&](const H& /*from*/, const H& to) {
+      handles[tree.deref(to).id] = to;
+    };
+    auto add = [&](float x, float y) {
+      movers.push_back({x, y, movers.size()});
+      handles.push_back({0, 0});
+      alive.push_back(true);
+      H h = tree.insert(movers.back(), onMove);
+      handles[movers.size() - 1] = h;
+    };
+    // Some of these are on the west and north edges of the first box,
+    // which end up on the wrong side of a split once it grows past them.
+    for (size_t i = 0; i < 2000; ++i) {
+      if (i % 10 == 0) add(c - 1.0f, c + rd(r));
+      else if (i % 10 == 1) add(c + rd(r), c - 1.0f);
+      else add(c + rd(r), c + rd(r));
+    }
+    for (size_t i = 0; i < 5000; ++i) add(300 * rd(r), 300 * rd(r));
+    if (tree.getBox().s.x < 300) ok = false;
+    zekku::Circle<float> near(glm::tvec2<float>{c - 1.0f, c}, 0.5f);
+    zekku::Circle<float> far(glm::tvec2<float>{100.0f, -50.0f}, 80.0f);
+    ok = ok && checkMovers(tree, movers, handles, alive, near) &&
+      checkMovers(tree, movers, handles, alive, far);
+    // Remove everything outside the first box, and half of the rest
+    for (size_t i = 0; i < movers.size() && ok; ++i) {
+      const Mover& m = movers[i];
+      bool inside = std::abs(m.x - c) <= 1 && std::abs(m.y - c) <= 1;
+      if (inside && i % 2 == 0) continue;
+      tree.remove(handles[i], onMove);
+      alive[i] = false;
+    }
+    ok = ok && tree.shrinkToFit() && tree.getBox().s.x <= 4 &&
+      checkMovers(tree, movers, handles, alive, near);
+    // And grow it again from an update
+    for (size_t i = 0; i < movers.size() && ok; ++i) {
+      if (!alive[i] || i % 3 != 0) continue;
+      movers[i].x -= 500;
+      handles[i] = tree.update(handles[i], movers[i], onMove);
+    }
+    ok = ok && checkMovers(tree, movers, handles, alive, near) &&
+      checkMovers(tree, movers, handles, alive, far);
+  }
+  // The box of a BoxQuadTree grows and shrinks the same way
+  zekku::BoxQuadTree<TestEntry, uint32_t> boxes({{0, 0}, {1, 1}});
+  std::vector<TestEntry> entries;
+  std::vector<uint32_t> ids;
+  for (size_t i = 0; i < 3000; ++i) {
+    TestEntry e;
+    float spread = i < 1000 ? 0.5f : 200.0f;
+    e.box.c = {spread * rd(r), spread * rd(r)};
+    e.box.s = {0.25f + 0.25f * rd(r), 0.25f + 0.25f * rd(r)};
+    entries.push_back(e);
+    ids.push_back(boxes.insert(e).index);
+  }
+  for (size_t k = 0; k < 20 && ok; ++k) {
+    zekku::AABB<float> query = {{200 * rd(r), 200 * rd(r)}, {20, 20}};
+    std::set<uint32_t> expected, actual;
+    for (uint32_t i = 0; i < entries.size(); ++i) {
+      if (query.intersects(entries[i].box)) expected.insert(ids[i]);
+    }
+    std::vector<zekku::BBHandle> out;
+    boxes.query(query, out);
+    for (const auto& h : out) actual.insert(h.index);
+    if (expected != actual) ok = false;
+  }
+  zekku::BoxQuadTree<TestEntry, uint32_t> sparse({{0, 0}, {1000, 1000}});
+  for (size_t i = 0; i < 500; ++i) {
+    TestEntry e;
+    e.box.c = {15 + 5 * rd(r), 15 + 5 * rd(r)};
+    e.box.s = {0.1f, 0.1f};
+    sparse.insert(e);
+  }
+  size_t found = 0;
+  ok = ok && sparse.shrinkToFit() && sparse.getBox().s.x < 1000;
+  sparse.query(zekku::AABB<float>{{15, 15}, {6, 6}},
+    [&found](const TestEntry&) { ++found; });
+  if (ok && found == 500) {
+    std::cerr << "Boxes grow and shrink :)\n";
+  } else {
+    std::cerr << "Growing or shrinking went wrong!\n";
+  }
+}
+
+// Runs the same batch of queries on both kinds of tree with more and more
+// workers, checking the merged hits against running them one by one.
+void testParallelQuery() {
+  std::cerr << "Testing parallel queries...\n";
+  std::mt19937_64 r(31);
+  std::uniform_real_distribution<float> rd(-1.0f, 1.0f);
+  zekku::QuadTree<Pair<float>, uint32_t> points({{0, 0}, {100, 100}});
+  zekku::BoxQuadTree<TestEntry, uint32_t> boxes({{0, 0}, {100, 100}});
+  for (size_t i = 0; i < opts.nObjects; ++i) {
+    points.insert({100 * rd(r), 100 * rd(r)});
+    TestEntry e;
+    e.box.c = {50 * rd(r), 50 * rd(r)};
+    e.box.s = {2.5 + 2.5 * rd(r), 2.5 + 2.5 * rd(r)};
+    boxes.insert(e);
+  }
+  std::vector<zekku::Circle<float>> shapes;
+  for (size_t i = 0; i < 50000; ++i) {
+    shapes.push_back(zekku::Circle<float>(
+      glm::tvec2<float>{100 * rd(r), 100 * rd(r)}, 5.0f));
+  }
+  std::vector<zekku::QueryHit<uint32_t>> pointHits;
+  std::vector<zekku::BasicQueryHit<zekku::BBHandle>> boxHits;
+  for (size_t i = 0; i < shapes.size(); ++i) {
+    std::vector<zekku::Handle<uint32_t>> hs;
+    points.query(shapes[i], hs);
+    for (const auto& h : hs) pointHits.push_back({i, h});
+    std::vector<zekku::BBHandle> bhs;
+    boxes.query(shapes[i], bhs);
+    for (const auto& h : bhs) boxHits.push_back({i, h});
+  }
+  auto same = [](const auto& a, const auto& b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+      if (a[i].query != b[i].query || !(a[i].handle == b[i].handle))
+        return false;
+    }
+    return true;
+  };
+  size_t maxThreads =
+    std::max<size_t>(4, zekku::WorkerPool::defaultWorkers());
+  bool ok = true;
+  using namespace std::chrono;
+  for (size_t threads = 1; threads <= maxThreads && ok; threads *= 2) {
+    zekku::WorkerPool pool(threads);
+    std::vector<zekku::QueryHit<uint32_t>> ph;
+    std::vector<zekku::BasicQueryHit<zekku::BBHandle>> bh;
+    auto ms = duration_cast<milliseconds>(
+      system_clock::now().time_since_epoch()
+    );
+    zekku::parallelQuery(pool, points, shapes, ph);
+    auto ms2 = duration_cast<milliseconds>(
+      system_clock::now().time_since_epoch()
+    );
+    zekku::parallelQuery(pool, boxes, shapes, bh);
+    auto ms3 = duration_cast<milliseconds>(
+      system_clock::now().time_since_epoch()
+    );
+    // Per-worker counts through the callback form
+    std::vector<size_t> counts(pool.size() * 8, 0);
+    zekku::parallelQuery(pool, points, shapes,
+      [&counts](size_t, const Pair<float>&, size_t worker) {
+        ++counts[worker * 8];
+      });
+    size_t total = 0;
+    for (size_t c : counts) total += c;
+    ok = same(ph, pointHits) && same(bh, boxHits) &&
+      total == pointHits.size();
+    fprintf(stderr,
+      "%zu threads: %zu point queries %ld ms, box queries %ld ms\n",
+      threads, shapes.size(),
+      (long) (ms2 - ms).count(), (long) (ms3 - ms2).count());
+  }
+  if (ok) {
+    std::cerr << "Parallel hits match :)\n";
+  } else {
+    std::cerr << "Parallel queries went wrong!\n";
+  }
+}
+
 bool readOpts(int argc, char** argv) {
   int k = 1;
   while (k < argc) {
@@ -498,9 +2217,34 @@ int main(int argc, char** argv) {
   printf("Testing...\n");
   printf("Object count = %zu\n", opts.nObjects);
   testPool();
+  testPoolFreeList();
+  benchPool();
+  testPoolIteration();
+  testPoolChunked();
+  testPoolCompact();
+  testConcurrentPool();
+  testPoolBulk();
+  testSoAPool();
+  testPoolAllocators();
+  testPoolShrink();
+  testPoolSnapshot();
+  testLeafKernels();
   testQTree();
   testQTreePathological();
+  testQTreeRemove();
+  testQTreeKnn();
+  testQTreeBuild();
+  testQTreeEarlyExit();
+  testQTreeBatch();
+  testQTreeCachedPositions();
+  testLinearQTree();
   testBBQTree(); // Mmm
+  testBBQTreeRemove();
+  testBBQTreePairs();
+  testBBQTreeJoin();
+  testBBQTreeLoose();
   testBBQTreeFixed();
+  testTreeGrowth();
+  testParallelQuery();
   return 0;
 }
\ No newline at end of file